@@ -1,12 +1,30 @@
 #include "TinyFS.h"
+#include "alloc.h"
+#include "trace.h"
+#include "diskMmap.h"
 
 static int mount = INVALID;
 static tfile table[MAX_NUM_FILES];
-
-static int isLEndian() {
-   int end = 0x01;
-   return *((uchar *)(&end));
-}
+/* First free descriptor, and the first open descriptor of each name bucket */
+static short freefd = -1;
+static short buckets[FD_BUCKETS];
+/* Root inode address of each mounted snapshot, NULL_ADDR if not mounted */
+static uchar snapshots[MAX_NUM_SNAPSHOTS];
+/* Root pointer index tfs_defrag resumes from */
+static int defragnext = 0;
+/* Set while the file system is mounted with tfs_mountReadOnly */
+static int mountreadonly = FALSE;
+/* Name index of a read-only mount, built once when it is mounted. Nothing can
+   change the image under it, so lookups never read the root again */
+static uchar indexinodes[MAX_NUM_FILES];
+static char indexnames[MAX_NUM_FILES][MAX_NAME_SIZE];
+static short indexnext[MAX_NUM_FILES];
+static short indexbuckets[FD_BUCKETS];
+/* Files in the root, and the quota of the root in blocks. A read-only mount
+   can't build the allocator, so it keeps the free count it mounted with */
+static int filecount = 0;
+static int rootquota = 0;
+static int mountfree = 0;
 
 static void initFD() {
    int loop = 0;
@@ -14,17 +32,113 @@ static void initFD() {
    memset(table, 0, sizeof(tfile) * MAX_NUM_FILES);
    for(loop = 0; loop < MAX_NUM_FILES; loop++) {
       table[loop].valid = INVALID;
+      table[loop].next = loop + 1 < MAX_NUM_FILES ? loop + 1 : -1;
+   }
+   freefd = 0;
+   for(loop = 0; loop < FD_BUCKETS; loop++)
+      buckets[loop] = -1;
+}
+
+static int namehash(char *name) {
+   unsigned hash = 5381;
+   int i;
+
+   for(i = 0; i < MAX_NAME_SIZE && name[i]; i++)
+      hash = hash * 33 + (uchar)name[i];
+   return hash % FD_BUCKETS;
+}
+
+/* Returns the descriptor the live file name is open as, or FILE_NOT_FOUND */
+static fileDescriptor findFD(char *name) {
+   fileDescriptor FD;
+
+   for(FD = buckets[namehash(name)]; FD >= 0; FD = table[FD].next) {
+      if(!strncmp(table[FD].name, name, MAX_NAME_SIZE))
+         return FD;
+   }
+   return FILE_NOT_FOUND;
+}
+
+static void hashFD(fileDescriptor FD) {
+   int bucket = namehash(table[FD].name);
+
+   table[FD].next = buckets[bucket];
+   buckets[bucket] = FD;
+}
+
+static void unhashFD(fileDescriptor FD) {
+   short *link = &buckets[namehash(table[FD].name)];
+
+   while(*link >= 0 && *link != FD)
+      link = &table[*link].next;
+   if(*link == FD)
+      *link = table[FD].next;
+}
+
+static int validFD(fileDescriptor FD) {
+   return FD >= 0 && FD < MAX_NUM_FILES && table[FD].valid == VALID;
+}
+
+/* Replaces the block map of a descriptor with the first nlogical entries of
+   map. The descriptor just goes without a map if there is no memory for one */
+static void setmap(fileDescriptor FD, uchar *map, int nlogical) {
+   uchar *copy = realloc(table[FD].map, nlogical);
+
+   if(!copy) {
+      free(table[FD].map);
+      table[FD].map = NULL;
+      table[FD].mapsize = 0;
+      return;
    }
+   memcpy(copy, map, nlogical);
+   table[FD].map = copy;
+   table[FD].mapsize = nlogical;
+}
+
+static void dropmap(fileDescriptor FD) {
+   free(table[FD].map);
+   table[FD].map = NULL;
+   table[FD].mapsize = 0;
 }
 
 static int getFileSize(uchar *buffer) {
-   int temp;
+   return load32(buffer + SIZE_INDEX);
+}
+
+static int blockinuse(uchar *bitmap, uchar blocknum) {
+   return GETBIT(bitmap[blocknum/BITS_PER_BYTE], 7 - blocknum % BITS_PER_BYTE);
+}
+
+static int diskblocks() {
+   return diskBlocks(mount);
+}
+
+/* Blocks of the first nblocks neither in use nor held in superblock super */
+static int countfree(uchar *super, int nblocks) {
+   int free = 0;
+   int blocknum;
+
+   for(blocknum = 0; blocknum < nblocks; blocknum++) {
+      free += !blockinuse(super + BITMAP_FIRST_ADDR, blocknum) &&
+              !blockinuse(super + HELD_FIRST_ADDR, blocknum);
+   }
+   return free;
+}
 
-   memcpy(&temp, buffer + 13, 4);
-   if(isLEndian())
-      temp = SWAP_ENDIAN_INT(temp);
+/* Blocks in use by files and snapshots, not counting the superblock and root */
+static int usedblocks() {
+   return diskblocks() - 2 - allocFreeCount();
+}
 
-   return temp;
+/* Returns QUOTA_EXCEEDED if a file going from oldblocks to newblocks data
+   blocks breaks its quota filequota, or if taking more new blocks from the
+   disk breaks the quota of the root. Nothing that shrinks is refused */
+static int checkquota(int filequota, int oldblocks, int newblocks, int more) {
+   if(filequota && newblocks > oldblocks && newblocks > filequota)
+      return QUOTA_EXCEEDED;
+   if(rootquota && more > 0 && usedblocks() + more > rootquota)
+      return QUOTA_EXCEEDED;
+   return 0;
 }
 
 static void setBitmap(uchar *bitmap, uchar blocknum, blockstate state) {
@@ -39,20 +153,41 @@ static void setBitmap(uchar *bitmap, uchar blocknum, blockstate state) {
 }
 
 /* Data MUST be of size BITMAP_SIZE */
-static void updateBitmap(uchar *bitmap) {
-   uchar block[BLOCKSIZE] = {0};
+static int updateBitmap(uchar *bitmap) {
+   uchar block[BLOCKSIZE];
+   int error = readCheckedBlock(mount, SUPERBLOCK_ADDR, block);
 
-   readBlock(mount, SUPERBLOCK_ADDR, block);
+   if(error)
+      return error;
    memcpy(block + 4, bitmap, BITMAP_SIZE);
-   writeBlock(mount, SUPERBLOCK_ADDR, block);
+   return writeCheckedBlock(mount, SUPERBLOCK_ADDR, block);
+}
+
+/* Writes the bitmap with every block in use in either ondisk, the bitmap as
+   it was read, or bitmap, so the blocks taken since are in use on disk before
+   anything points at them while those being let go stay in use until nothing
+   does. Writes nothing if no block was taken */
+static int reserveblocks(uchar *ondisk, uchar *bitmap) {
+   uchar both[BITMAP_SIZE];
+   int taken = FALSE;
+   int loop;
+
+   for(loop = 0; loop < BITMAP_SIZE; loop++) {
+      both[loop] = ondisk[loop] | bitmap[loop];
+      if(both[loop] != ondisk[loop])
+         taken = TRUE;
+   }
+   return taken ? updateBitmap(both) : 0;
 }
 
 static int getrootindex(uchar blocknum) {
    uchar block[BLOCKSIZE];
    uchar index = 0;
+   int error = readCheckedBlock(mount, ROOT_ADDR, block);
 
-   readBlock(mount, ROOT_ADDR, block);
-   while((index + 12) < BLOCKSIZE) {
+   if(error)
+      return error;
+   while((index + 12) < CHECKSUM_INDEX) {
       if(block[index + 12] == blocknum)
          return index;
       index++;
@@ -61,13 +196,14 @@ static int getrootindex(uchar blocknum) {
 }
 
 /* Index 0 is first byte of inode pointers in root inode */
-static void updateroot(uchar blocknum, uchar index) {
+static int updateroot(uchar blocknum, uchar index) {
    uchar block[BLOCKSIZE];
+   int error = readCheckedBlock(mount, ROOT_ADDR, block);
 
-   index += 12;
-   readBlock(mount, ROOT_ADDR, block);
-   block[index] = blocknum;
-   writeBlock(mount, ROOT_ADDR, block);
+   if(error)
+      return error;
+   block[index + 12] = blocknum;
+   return writeCheckedBlock(mount, ROOT_ADDR, block);
 }
 
 static uchar *makeinode(uchar fileaddr, char *filename, uchar *block, int size,
@@ -81,11 +217,9 @@ static uchar *makeinode(uchar fileaddr, char *filename, uchar *block, int size,
       block[3] = VALID;
    else
       block[3] = INVALID;
-   strncpy((char *)block + 4, filename, MAX_NAME_SIZE);
-   block[12] = usedblocks;
-   if(isLEndian())
-      size = SWAP_ENDIAN_INT(size);
-   memcpy(block + 13, &size, 4);
+   strncpy((char *)block + NAME_INDEX, filename, MAX_NAME_SIZE);
+   block[BLOCKS_INDEX] = usedblocks;
+   store32(block + SIZE_INDEX, size);
    return block;
 }
 
@@ -103,12 +237,19 @@ static uchar *makedatablock(uchar nextblockaddr, uchar *data, uchar *block) {
    return block;
 }
 
-static uchar *makefreeblock(uchar *block) {
-   memset(block, 0x00, BLOCKSIZE);
-   block[0] = FREE_BLOCK;
-   block[1] = MAGIC_NUM;
-   block[3] = INVALID;
-   return block;
+/* Tells the disk the blocks set in freed hold nothing any more, one discard
+   per run of neighbouring blocks. Free blocks are known by the bitmap alone,
+   so this is only advice and failures are ignored */
+static void discardruns(uchar *freed) {
+   int start;
+   int end;
+
+   for(start = 0; start < MAX_NUM_BLOCKS; start = end + 1) {
+      for(end = start; end < MAX_NUM_BLOCKS && freed[end]; end++)
+         ;
+      if(end > start)
+         discardCheckedBlocks(mount, start, end - start);
+   }
 }
 
 static uchar *makesuperblock(uchar *bitmap, uchar *block) {
@@ -118,56 +259,530 @@ static uchar *makesuperblock(uchar *bitmap, uchar *block) {
    block[2] = ROOT_ADDR;
    block[3] = VALID;
    memcpy(block + 4, bitmap, BITMAP_SIZE);
+   block[STATE_INDEX] = FS_CLEAN;
    return block;
 }
 
-static fileDescriptor createFile(char *name) {
-   fileDescriptor file;
+static void putFileSize(uchar *inode, int size) {
+   store32(inode + SIZE_INDEX, size);
+}
+
+static void putstamp(uchar *inode, int index, time_t timet) {
+   store64(inode + index, timet);
+}
+
+/* Number of logical blocks in a file of size bytes; an empty file has one */
+static int fileblocks(int size) {
+   return (size - 1)/DATA_SIZE + 1;
+}
+
+/* Decodes every field of the inode block into ino */
+static void decodeinode(uchar *block, tinode *ino) {
+   dinode *raw = (dinode *)block;
+   int entry;
+
+   ino->first = raw->first;
+   ino->blocks = raw->blocks;
+   ino->size = load32(raw->size);
+   ino->created = load64(raw->created);
+   ino->modified = load64(raw->modified);
+   ino->accessed = load64(raw->accessed);
+   for(entry = 0; entry < MAX_NUM_HOLES; entry++) {
+      ino->holestart[entry] = load16(raw->holes[entry]);
+      ino->holecount[entry] = load16(raw->holes[entry] + 2);
+   }
+   ino->quota = load16(raw->quota);
+}
+
+/* Fills chain with the data blocks of the file in inode, in order, and
+   returns how many there are. The block count in the inode ends the chain, the
+   next pointer of the last block is not trusted */
+static int readchain(uchar *inode, uchar *chain) {
+   uchar block[BLOCKSIZE];
+   int count = 0;
+   int blocksused = inode[BLOCKS_INDEX];
+
+   chain[0] = inode[2];
+   while(count < blocksused && chain[count] != NULL_ADDR) {
+      if(count + 1 < blocksused) {
+         if(readCheckedBlock(mount, chain[count], block) != 0)
+            return READ_ERROR;
+         chain[count + 1] = block[2];
+      }
+      count++;
+   }
+   return count;
+}
+
+/* Fills map with the block holding each of the first nlogical blocks of the
+   file, NULL_ADDR where the file has a hole */
+static void buildmap(uchar *inode, uchar *chain, int count, uchar *map, int nlogical) {
+   tinode ino;
+   int logical;
+   int entry = 0;
+   int next = 0;
+
+   decodeinode(inode, &ino);
+   for(logical = 0; logical < nlogical; logical++) {
+      while(entry < MAX_NUM_HOLES && ino.holecount[entry] &&
+            ino.holestart[entry] + ino.holecount[entry] <= logical)
+         entry++;
+      if(entry < MAX_NUM_HOLES && ino.holecount[entry] && ino.holestart[entry] <= logical)
+         map[logical] = NULL_ADDR;
+      else
+         map[logical] = next < count ? chain[next++] : NULL_ADDR;
+   }
+}
+
+/* Returns the number of holes (runs of NULL_ADDR) in map */
+static int countholes(uchar *map, int nlogical) {
+   int logical;
+   int holes = 0;
+
+   for(logical = 0; logical < nlogical; logical++) {
+      if(map[logical] == NULL_ADDR && (!logical || map[logical - 1] != NULL_ADDR))
+         holes++;
+   }
+   return holes;
+}
+
+/* Rewrites the hole table of inode from map, which must have no more than
+   MAX_NUM_HOLES holes */
+static void storeholes(uchar *inode, uchar *map, int nlogical) {
+   uchar *hole = inode + HOLE_INDEX;
+   int logical = 0;
+   int start;
+
+   memset(hole, 0, MAX_NUM_HOLES * HOLE_ENTRY_SIZE);
+   while(logical < nlogical) {
+      if(map[logical] != NULL_ADDR) {
+         logical++;
+         continue;
+      }
+      for(start = logical; logical < nlogical && map[logical] == NULL_ADDR; logical++)
+         ;
+      store16(hole, start);
+      store16(hole + 2, logical - start);
+      hole += HOLE_ENTRY_SIZE;
+   }
+}
+
+/* Sets map[i] to NULL_ADDR for every logical block of the size bytes in
+   buffer that becomes a hole, and to TRUE for the rest. All-zero blocks become
+   holes and take no space, as long as the inode has room to record them.
+   Returns the number of blocks that need space */
+static int markholes(char *buffer, int size, uchar *map) {
+   static const char zero[DATA_SIZE];
+   int nlogical = fileblocks(size);
+   int materialized = 0;
+   int holes = 0;
+   int logical;
+   int copy;
+
+   for(logical = 0; logical < nlogical; logical++) {
+      copy = size - logical * DATA_SIZE;
+      if(copy > DATA_SIZE)
+         copy = DATA_SIZE;
+      if(!memcmp(buffer + logical * DATA_SIZE, zero, copy) &&
+         ((logical && map[logical - 1] == NULL_ADDR) || holes++ < MAX_NUM_HOLES))
+         map[logical] = NULL_ADDR;
+      else {
+         map[logical] = TRUE;
+         materialized++;
+      }
+   }
+   return materialized;
+}
+
+/* Returns the block holding logical block logical of the file in inode,
+   NULL_ADDR if it is a hole */
+static int physblock(uchar *inode, int logical) {
+   uchar block[BLOCKSIZE];
+   tinode ino;
+   int entry;
+   int start;
+   int holes;
+   int index = logical;
+   int addr;
+
+   decodeinode(inode, &ino);
+   addr = ino.first;
+   for(entry = 0; entry < MAX_NUM_HOLES; entry++) {
+      start = ino.holestart[entry];
+      holes = ino.holecount[entry];
+      if(holes && logical >= start && logical < start + holes)
+         return NULL_ADDR;
+      if(holes && start + holes <= logical)
+         index -= holes;
+   }
+   if(index >= ino.blocks)
+      return NULL_ADDR;
+   while(index-- > 0) {
+      if(readCheckedBlock(mount, addr, block) != 0)
+         return READ_ERROR;
+      addr = block[2];
+   }
+   return addr;
+}
+
+/* Gives every hole in map from first up to last a new block, marked in fresh,
+   allocating them as one run where possible */
+static int fillholes(uchar *map, int first, int last, uchar *fresh, uchar *bitmap,
+                     int hint) {
+   int logical;
+   int want = 0;
+   int addr = 0;
+   int got = 0;
+
+   for(logical = first; logical < last; logical++)
+      want += map[logical] == NULL_ADDR;
+   for(logical = first; logical < last; logical++) {
+      if(map[logical] != NULL_ADDR) {
+         hint = map[logical] + 1;
+         continue;
+      }
+      if(!got) {
+         addr = allocExtent(hint, want, &got);
+         if(addr == ROOT_DIRECTORY_FULL)
+            return ROOT_DIRECTORY_FULL;
+         want -= got;
+      }
+      map[logical] = addr;
+      fresh[addr] = TRUE;
+      setBitmap(bitmap, addr, USED);
+      hint = ++addr;
+      got--;
+   }
+   return 0;
+}
+
+/* Writes the chain described by map after tfs_truncate or tfs_fallocate
+   changed it. Blocks marked in fresh are written out as zeros; other blocks
+   are only rewritten when the block after them changed, and a block held by a
+   snapshot is copied rather than rewritten. Every block taken, in fresh or
+   for a copy, is marked in use on disk against ondisk before the first write.
+   Updates the chain and holes in inode to match */
+static int writechain(uchar *inode, uchar *oldchain, int oldcount, uchar *map,
+                      int nlogical, uchar *fresh, uchar *bitmap, uchar *held,
+                      uchar *ondisk) {
+   uchar block[BLOCKSIZE];
+   uchar zero[DATA_SIZE] = {0};
+   uchar chain[MAX_NUM_BLOCKS];
+   uchar source[MAX_NUM_BLOCKS];
+   uchar rewrite[MAX_NUM_BLOCKS];
+   short logicalof[MAX_NUM_BLOCKS];
+   short oldnext[MAX_NUM_BLOCKS];
+   int count = 0;
+   int logical;
+   int next;
+   int copy;
+   int got;
+   int error;
    int i;
+
+   for(logical = 0; logical < nlogical; logical++) {
+      if(map[logical] != NULL_ADDR) {
+         logicalof[count] = logical;
+         chain[count++] = map[logical];
+      }
+   }
+   for(i = 0; i < MAX_NUM_BLOCKS; i++)
+      oldnext[i] = -1;
+   for(i = 0; i < oldcount; i++)
+      oldnext[oldchain[i]] = i + 1 < oldcount ? oldchain[i + 1] : NULL_ADDR;
+
+   // The copies are picked back to front before anything is written, since
+   // a copy changes the pointer of the block before it
+   for(i = count - 1; i >= 0; i--) {
+      next = i + 1 < count ? chain[i + 1] : NULL_ADDR;
+      source[i] = chain[i];
+      rewrite[i] = fresh[chain[i]] ||
+                   (next != NULL_ADDR && oldnext[chain[i]] != next);
+      if(!rewrite[i] || fresh[chain[i]] || !blockinuse(held, chain[i]))
+         continue;
+      copy = allocExtent(chain[i] + 1, 1, &got);
+      if(copy == ROOT_DIRECTORY_FULL)
+         return ROOT_DIRECTORY_FULL;
+      setBitmap(bitmap, chain[i], FREE);
+      setBitmap(bitmap, copy, USED);
+      chain[i] = map[logicalof[i]] = copy;
+   }
+   if((error = reserveblocks(ondisk, bitmap)) != 0)
+      return error;
+
+   // Back to front, so each block is written after the one it points to
+   for(i = count - 1; i >= 0; i--) {
+      if(!rewrite[i])
+         continue;
+      next = i + 1 < count ? chain[i + 1] : NULL_ADDR;
+      if(fresh[chain[i]]) {
+         makedatablock(next, zero, block);
+      }
+      else {
+         if(readCheckedBlock(mount, source[i], block) != 0)
+            return READ_ERROR;
+         block[2] = next;
+         block[3] = VALID;
+      }
+      if(writeCheckedBlock(mount, chain[i], block) != 0)
+         return WRITE_ERROR;
+   }
+
+   inode[2] = count ? chain[0] : NULL_ADDR;
+   inode[3] = count ? VALID : INVALID;
+   inode[BLOCKS_INDEX] = count;
+   storeholes(inode, map, nlogical);
+   return 0;
+}
+
+/* Zeroes the bytes of the last block of a file of size bytes that lie past
+   its end, so growing the file doesn't expose what truncate left behind */
+static int zerotail(uchar *map, int size, uchar *bitmap, uchar *held) {
+   uchar block[BLOCKSIZE];
+   int logical = fileblocks(size) - 1;
+   int used = size - logical * DATA_SIZE;
+   int addr = map[logical];
+   int got;
+
+   if(addr == NULL_ADDR || used == DATA_SIZE)
+      return 0;
+   if(readCheckedBlock(mount, addr, block) != 0)
+      return READ_ERROR;
+   memset(block + 4 + used, 0x00, DATA_SIZE - used);
+   if(blockinuse(held, addr)) {
+      addr = allocExtent(addr + 1, 1, &got);
+      if(addr == ROOT_DIRECTORY_FULL)
+         return ROOT_DIRECTORY_FULL;
+      setBitmap(bitmap, map[logical], FREE);
+      setBitmap(bitmap, addr, USED);
+      map[logical] = addr;
+   }
+   return writeCheckedBlock(mount, addr, block);
+}
+
+/* Points the descriptor of the live file name, if it is open, back at the
+   blocks in map and sets its size */
+static void refreshfds(char *name, uchar *map, int nlogical, int size) {
+   fileDescriptor FD = findFD(name);
+   int logical;
+
+   if(FD < 0)
+      return;
+   logical = table[FD].pos / DATA_SIZE;
+   if(table[FD].pos > size || logical >= nlogical) {
+      table[FD].pos = 0;
+      logical = 0;
+   }
+   table[FD].blocknum = map[0];
+   table[FD].current_block = map[logical];
+   table[FD].size = size;
+   setmap(FD, map, nlogical);
+}
+
+/* Marks the blocks streaming writes have taken in use again. They reach the
+   bitmap only at tfs_writeCommit(), so a rebuilt tree would hand them out */
+static void reservestreams() {
+   fileDescriptor FD;
+   tstream *stream;
+   int logical;
+
+   for(FD = 0; FD < MAX_NUM_FILES; FD++) {
+      if(table[FD].valid != VALID || !(stream = table[FD].stream))
+         continue;
+      for(logical = 0; logical < stream->nlogical; logical++) {
+         if(stream->map[logical] != NULL_ADDR)
+            allocMark(stream->map[logical], 1, USED);
+      }
+   }
+}
+
+/* Rebuilds the free extent tree from the bitmaps on disk. Operations that fail
+   after allocating call this to give back what they took */
+static void syncalloc() {
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   int loop;
+
+   // Blocks held by a snapshot are as unavailable as live ones. Without the
+   // bitmaps the tree is left as it is, which can only leak
+   if(getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return;
+   for(loop = 0; loop < BITMAP_SIZE; loop++)
+      bitmap[loop] |= held[loop];
+   allocInit(bitmap, diskblocks());
+   reservestreams();
+}
+
+/* Allocates a spot in process file table for the file with inode inode, whose
+   first data block is blocknum, in the directory rooted at root */
+static fileDescriptor allocFD(char *name, uchar blocknum, uchar root, uchar inode,
+                              int size) {
+   fileDescriptor FD = freefd;
+
+   if (FD < 0)
+      return ROOT_DIRECTORY_FULL;
+   freefd = table[FD].next;
+
+   memset(&table[FD], 0, sizeof(tfile));
+   table[FD].blocknum = blocknum;
+   table[FD].pos = 0;
+   table[FD].valid = VALID;
+   strncpy(table[FD].name, name, MAX_NAME_SIZE);
+   table[FD].current_block = blocknum;
+   table[FD].root = root;
+   table[FD].readonly = root != ROOT_ADDR || mountreadonly;
+   table[FD].inode = inode;
+   table[FD].size = size;
+   table[FD].next = -1;
+   // Only live files can be reopened, snapshot files stay out of the map
+   if (root == ROOT_ADDR)
+      hashFD(FD);
+   return FD;
+}
+
+/* Writes the access time a descriptor has been holding back to its inode */
+static int flushFD(fileDescriptor FD) {
+   uchar inode[BLOCKSIZE];
+
+   if (!table[FD].accessed || table[FD].readonly)
+      return 0;
+   if (readCheckedBlock(mount, table[FD].inode, inode) != 0)
+      return READ_ERROR;
+   putstamp(inode, ACCESS_INDEX, table[FD].accessed);
+   table[FD].accessed = 0;
+   return writeCheckedBlock(mount, table[FD].inode, inode);
+}
+
+/* Ends the streaming write on a descriptor, if there is one, giving back the
+   blocks its new version took. None of them is in the bitmap yet */
+static void dropstream(fileDescriptor FD) {
+   tstream *stream = table[FD].stream;
+   int logical;
+
+   if (!stream)
+      return;
+   for (logical = 0; logical < stream->nlogical; logical++) {
+      if (stream->map[logical] != NULL_ADDR)
+         allocMark(stream->map[logical], 1, FREE);
+   }
+   free(stream);
+   table[FD].stream = NULL;
+}
+
+static void releaseFD(fileDescriptor FD) {
+   if (table[FD].root == ROOT_ADDR)
+      unhashFD(FD);
+   dropmap(FD);
+   dropstream(FD);
+   memset(&table[FD], 0, sizeof(tfile));
+   table[FD].valid = INVALID;
+   table[FD].next = freefd;
+   freefd = FD;
+}
+
+static int fdinode(fileDescriptor FD) {
+   return table[FD].inode;
+}
+
+/* Returns the block map of a descriptor and stores its length in count. The
+   first call walks the chain once and keeps the result, every call after that
+   is a lookup. Without memory to keep it the map is built in local instead.
+   Returns NULL if the chain can't be read */
+static uchar *filemap(fileDescriptor FD, uchar *local, int *count) {
+   uchar inode[BLOCKSIZE];
+   uchar chain[MAX_NUM_BLOCKS];
+   int nlogical = fileblocks(table[FD].size);
+   int chainlen;
+
+   if (!table[FD].map) {
+      if (readCheckedBlock(mount, fdinode(FD), inode) != 0)
+         return NULL;
+      chainlen = readchain(inode, chain);
+      if (chainlen < 0)
+         return NULL;
+      buildmap(inode, chain, chainlen, local, nlogical);
+      setmap(FD, local, nlogical);
+      if (!table[FD].map) {
+         *count = nlogical;
+         return local;
+      }
+   }
+   *count = table[FD].mapsize;
+   return table[FD].map;
+}
+
+/* Moves the descriptor to byte offset of its file, finding the block that
+   holds it unless it is in the block the descriptor is already on */
+static int moveFD(fileDescriptor FD, long offset) {
+   uchar local[MAX_FILE_BLOCKS];
+   uchar *map;
+   int logical = offset / DATA_SIZE;
+   int count;
+
+   if (logical != table[FD].pos / DATA_SIZE) {
+      map = filemap(FD, local, &count);
+      if (!map)
+         return READ_ERROR;
+      table[FD].current_block = logical < count ? map[logical] : NULL_ADDR;
+   }
+   table[FD].pos = offset;
+   return 0;
+}
+
+static fileDescriptor createFile(char *name) {
    int rootIndex;
-   int inodeblock = nextFreeBlock(mount, 0);
-   int datablock = nextFreeBlock(mount, 1);
+   int inodeblock;
+   int datablock;
+   int got;
    uchar buf[BLOCKSIZE];
    uchar junk[BLOCKSIZE] = {0};
    uchar bitmap[BITMAP_SIZE];
+   time_t now = time(NULL);
+   int error;
 
-   getBitmap(mount, bitmap);
-   setBitmap(bitmap, inodeblock, USED);
-   setBitmap(bitmap, datablock, USED);
-   updateBitmap(bitmap);
    // update root inode iterate
    // through setting first unused
    // block to 2 counting up from there
    rootIndex = nextRootAddrIndex(mount);
-   if (rootIndex == ROOT_DIRECTORY_FULL)
+   if (rootIndex < 0)
+      return rootIndex;
+
+   if (allocFreeCount() < 2 || freefd < 0)
       return ROOT_DIRECTORY_FULL;
- 
-   // Set address of file inode next
-   // in open space of root inode
-   
-   // Make inode
-   makeinode(datablock, name, buf, 0, 1);
-   writeBlock(mount, inodeblock, buf);
-   updateroot(inodeblock, rootIndex);
-
-   // Make datablock
-   makedatablock(NULL_ADDR, junk, buf);
-   writeBlock(mount, datablock, buf);
-   
-   // Allocate a spot in process file table
-   for (i = 0; i < MAX_NUM_FILES; i++) {
-      if (table[i].valid == INVALID) {
-         file = i;
-         table[i].blocknum = datablock;
-         table[i].pos = 0;
-         table[i].valid = VALID;
-         strncpy(table[i].name, name, MAX_NAME_SIZE);
-         table[i].current_block = datablock;
-         return file;
-      }
+   if ((error = checkquota(0, 0, 1, 2)) != 0)
+      return error;
+   inodeblock = allocInode();
+   datablock = allocExtent(inodeblock + 1, 1, &got);
+
+   // The bitmap, data block and inode go out before the root points at
+   // them, so a crash part way through can only leak the two blocks
+   error = getBitmap(mount, bitmap);
+   if (!error) {
+      setBitmap(bitmap, inodeblock, USED);
+      setBitmap(bitmap, datablock, USED);
+      error = updateBitmap(bitmap);
+   }
+   if (!error) {
+      makedatablock(NULL_ADDR, junk, buf);
+      error = writeCheckedBlock(mount, datablock, buf);
+   }
+   if (!error) {
+      // Make inode, timestamps included
+      makeinode(datablock, name, buf, 0, 1);
+      putstamp(buf, CREATION_INDEX, now);
+      putstamp(buf, MOD_INDEX, now);
+      putstamp(buf, ACCESS_INDEX, now);
+      error = writeCheckedBlock(mount, inodeblock, buf);
+   }
+   if (!error)
+      error = updateroot(inodeblock, rootIndex);
+   if (error) {
+      syncalloc();
+      return error;
    }
+   filecount++;
 
-   return ROOT_DIRECTORY_FULL;
+   return allocFD(name, datablock, ROOT_ADDR, inodeblock, 0);
 }
 
 static uchar *initsuperblock(uchar *block) {
@@ -178,387 +793,2296 @@ static uchar *initsuperblock(uchar *block) {
    return block;
 }
 
-static time_t getTime(uchar inodenum, timestamp ts) {
-   time_t timet = 0;
-   uchar inode[BLOCKSIZE] = {0};
-   uchar index = 0;
+/* Only the superblock and root are written. The disk sizes the image, and
+   every other block is free because the bitmap says so */
+static int makefs(char *filename, int nBytes) {
+   int disknum = INVALID;
+   int blocknum = (nBytes - 1)/BLOCKSIZE + 1;
+   char root[8] = {'r','o','o','t'};
+   uchar block[BLOCKSIZE];
 
-   readBlock(mount, inodenum, inode);
+   if(!filename || !strcmp(filename, "")) 
+      filename = DEFAULT_DISK_NAME;
+   disknum = openDisk(filename, nBytes);
+   if(disknum == -1)
+      return OPEN_FAILURE;
 
-   if(ts == CREATED)
-      index = CREATION_INDEX;
-   else if(ts == MODIFIED)
-      index = MOD_INDEX;
-   else if(ts == ACCESSED)
-      index = ACCESS_INDEX;
+   //set super-block
+   initsuperblock(block);
+   store16(block + FREE_COUNT_INDEX,
+           (blocknum < MAX_NUM_BLOCKS ? blocknum : MAX_NUM_BLOCKS) - 2);
+   if(writeCheckedBlock(disknum, SUPERBLOCK_ADDR, block) != 0)
+      return WRITE_ERROR;
 
-   memcpy(&timet, inode + index, sizeof(time_t));
-   
-   if(isLEndian())
-      timet = SWAP_ENDIAN_LONG(timet);
+   //set root inode
+   makeinode(NULL_ADDR, root, block, 0, 0);
+   if(writeCheckedBlock(disknum, ROOT_ADDR, block) != 0)
+      return WRITE_ERROR;
 
-   return timet;
+   return 0;
 }
 
-static void updateTime(uchar inodenum, timestamp ts) {
-   time_t timet = time(NULL);
-   uchar inode[BLOCKSIZE] = {0};
-   uchar index = 0;
+int tfs_mkfs(char *filename, int nBytes) {
+   uint64_t start = traceBegin();
+   int result = makefs(filename, nBytes);
 
-   if(isLEndian())
-      timet = SWAP_ENDIAN_LONG(timet);
+   traceEnd(TRACE_MKFS, start, -1, NULL, 0, nBytes, result);
+   return result;
+}
 
-   readBlock(mount, inodenum, inode);
+/* Lays out file index of a tfs_pack in image, its inode at addr and its
+   data in the blocks right after it. Returns the first block after the file */
+static int packfile(uchar (*image)[BLOCKSIZE], int addr, char *name,
+                    char *buffer, int size, uchar *bitmap) {
+   uchar map[MAX_FILE_BLOCKS];
+   char data[DATA_SIZE];
+   int nlogical = fileblocks(size);
+   int inodeblock = addr++;
+   int materialized = markholes(buffer, size, map);
+   int logical;
+   int next;
+   int copy;
+   time_t now = time(NULL);
 
-   if(ts == CREATED)
-      index = CREATION_INDEX;
-   else if(ts == MODIFIED)
-      index = MOD_INDEX;
-   else if(ts == ACCESSED)
-      index = ACCESS_INDEX;
-   else {
-      fprintf(stderr, "Invalid argument for arg 2 of updateTime\n");
-      close(-1);
+   for(logical = 0; logical < nlogical; logical++) {
+      if(map[logical] != NULL_ADDR)
+         map[logical] = addr++;
+   }
+   for(logical = 0, next = 0; logical < nlogical; logical++) {
+      if(map[logical] == NULL_ADDR)
+         continue;
+      // Data blocks are consecutive, so each points at the next one used
+      for(next = logical + 1; next < nlogical && map[next] == NULL_ADDR; next++)
+         ;
+      copy = size - logical * DATA_SIZE;
+      if(copy > DATA_SIZE)
+         copy = DATA_SIZE;
+      memset(data, 0x00, DATA_SIZE);
+      memcpy(data, buffer + logical * DATA_SIZE, copy);
+      makedatablock(next < nlogical ? map[next] : NULL_ADDR, (uchar *)data,
+                    image[map[logical]]);
+      setBitmap(bitmap, map[logical], USED);
    }
 
-   memcpy(inode + index, &timet, sizeof(time_t));
-   writeBlock(mount, inodenum, inode);
+   makeinode(materialized ? inodeblock + 1 : NULL_ADDR, name, image[inodeblock],
+             size, materialized);
+   storeholes(image[inodeblock], map, nlogical);
+   putstamp(image[inodeblock], CREATION_INDEX, now);
+   putstamp(image[inodeblock], MOD_INDEX, now);
+   putstamp(image[inodeblock], ACCESS_INDEX, now);
+   setBitmap(bitmap, inodeblock, USED);
+   return addr;
 }
 
-int tfs_mkfs(char *filename, int nBytes) {
-   int addr = 2;
-   int disknum = INVALID;
-   int blocknum = (nBytes - 1)/BLOCKSIZE + 1;
+int tfs_pack(char *filename, int nBytes, char **names, char **buffers,
+             int *sizes, int count) {
+   uchar bitmap[BITMAP_SIZE] = {DEFAULT_FIRST_BITMAP_BYTE};
+   uchar map[MAX_FILE_BLOCKS];
+   uchar (*image)[BLOCKSIZE];
    char root[8] = {'r','o','o','t'};
-   uchar block[BLOCKSIZE] = {0};
+   int needed = 2;
+   int nblocks;
+   int disknum;
+   int used;
+   int addr;
+   int error = 0;
+   int i;
+   int j;
 
-   if(!filename || !strcmp(filename, "")) 
-      filename = DEFAULT_DISK_NAME;
+   if(count < 0)
+      return WRITE_ERROR;
+   if(count > MAX_NUM_FILES)
+      return ROOT_DIRECTORY_FULL;
+   for(i = 0; i < count; i++) {
+      if(sizes[i] < 0)
+         return WRITE_ERROR;
+      if(fileblocks(sizes[i]) > MAX_FILE_BLOCKS)
+         return FILE_TOO_LARGE;
+      for(j = 0; j < i; j++) {
+         if(!strncmp(names[i], names[j], MAX_NAME_SIZE))
+            return WRITE_ERROR;
+      }
+      needed += 1 + markholes(buffers[i], sizes[i], map);
+   }
+   if(nBytes <= 0)
+      nBytes = needed * BLOCKSIZE;
+   nblocks = (nBytes - 1)/BLOCKSIZE + 1;
+   if(nblocks > MAX_NUM_BLOCKS)
+      nblocks = MAX_NUM_BLOCKS;
+   if(needed > nblocks)
+      return ROOT_DIRECTORY_FULL;
+
+   image = malloc(nblocks * BLOCKSIZE);
+   if(!image)
+      return WRITE_ERROR;
+   makeinode(NULL_ADDR, root, image[ROOT_ADDR], 0, 0);
+   for(i = 0, addr = 2; i < count; i++) {
+      image[ROOT_ADDR][ROOT_FIRST_ADDR + i] = addr;
+      addr = packfile(image, addr, names[i], buffers[i], sizes[i], bitmap);
+   }
+   used = addr;
+   makesuperblock(bitmap, image[SUPERBLOCK_ADDR]);
+   store16(image[SUPERBLOCK_ADDR] + FREE_COUNT_INDEX,
+           countfree(image[SUPERBLOCK_ADDR], nblocks));
+   store16(image[SUPERBLOCK_ADDR] + FILE_COUNT_INDEX, count);
+
+   // The image goes out front to back in one pass, up to the last file.
+   // The free blocks after it are left to the disk, like tfs_mkfs()
    disknum = openDisk(filename, nBytes);
-   if(disknum == -1)
+   if(disknum < 0) {
+      free(image);
       return OPEN_FAILURE;
+   }
+   for(addr = 0; addr < used && !error; addr++)
+      error = writeCheckedBlock(disknum, addr, image[addr]);
+   closeDisk(disknum);
+   free(image);
+   return error ? WRITE_ERROR : 0;
+}
 
-   //set super-block
-   initsuperblock(block);
-   writeBlock(disknum, SUPERBLOCK_ADDR, block);
+/* Returns the number of files in the root */
+static int countfiles() {
+   uchar root[BLOCKSIZE];
+   int count = 0;
+   int loop;
 
-   //set root inode
-   makeinode(NULL_ADDR, root, block, 0, 0);
-   writeBlock(disknum, ROOT_ADDR, block);
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++)
+      count += root[loop] != NULL_ADDR;
+   return count;
+}
 
-   //set rest of blocks to free
-   makefreeblock(block);
-   for(addr = 2; addr < (MAX_NUM_FREE_BLOCKS + 2) && addr < blocknum; addr++) {
-      writeBlock(disknum, addr, block);
+/* Fills the name index of a read-only mount from the root */
+static int buildindex() {
+   uchar root[BLOCKSIZE];
+   uchar inode[BLOCKSIZE];
+   int count = 0;
+   int slot;
+   int hash;
+
+   for(hash = 0; hash < FD_BUCKETS; hash++)
+      indexbuckets[hash] = -1;
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   for(slot = 0; slot < MAX_NUM_FILES; slot++) {
+      if(root[ROOT_FIRST_ADDR + slot] == NULL_ADDR)
+         continue;
+      if(readCheckedBlock(mount, root[ROOT_FIRST_ADDR + slot], inode) != 0)
+         return READ_ERROR;
+      indexinodes[count] = root[ROOT_FIRST_ADDR + slot];
+      memcpy(indexnames[count], inode + NAME_INDEX, MAX_NAME_SIZE);
+      hash = namehash((char *)inode + NAME_INDEX);
+      indexnext[count] = indexbuckets[hash];
+      indexbuckets[hash] = count++;
    }
-
    return 0;
 }
 
-int tfs_mount(char *filename) {
+/* Returns the inode block of file name from the index of a read-only mount,
+   or FILE_NOT_FOUND */
+static int indexlookup(char *name) {
+   int entry;
+
+   for(entry = indexbuckets[namehash(name)]; entry >= 0; entry = indexnext[entry]) {
+      if(!strncmp(indexnames[entry], name, MAX_NAME_SIZE))
+         return indexinodes[entry];
+   }
+   return FILE_NOT_FOUND;
+}
+
+/* Mounts filename, read-only through a shared mapping if readonly is set.
+   checkfs() only runs if the file system wasn't unmounted cleanly, and a
+   read-write mount marks it in use until it is unmounted */
+static int mountfs(char *filename, int readonly) {
+   uchar super[BLOCKSIZE];
+   int error;
+
    if(mount != INVALID) {
       return OPEN_FAILURE;
    }
    
-   mount = findFile(filename);
+   // Read-only mounts always map the image, even if it is already open here
+   if(readonly)
+      mount = openDiskWith(filename, 0, &mmapDiskOps);
+   else
+      mount = findFile(filename);
+   // Images formatted by another process, or unmounted earlier, are opened
+   if(mount == -1 && !readonly)
+      mount = openDisk(filename, 0);
    if(mount == -1) {
       mount = INVALID;
       return OPEN_FAILURE;
    }
    assert(mount >= 0);
 
-   if(checkfs(mount) == CORRUPT_FS)
+   if(readCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0 ||
+      (super[STATE_INDEX] != FS_CLEAN && checkfs(mount) == CORRUPT_FS) ||
+      (readonly && buildindex() != 0)) {
+      closeDisk(mount);
+      mount = INVALID;
       return CORRUPT_FS;
+   }
+   // The counters saved at unmount are only right if it was clean
+   rootquota = load16(super + ROOT_QUOTA_INDEX);
+   filecount = load16(super + FILE_COUNT_INDEX);
+   mountfree = load16(super + FREE_COUNT_INDEX);
+   if(super[STATE_INDEX] != FS_CLEAN) {
+      filecount = countfiles();
+      mountfree = countfree(super, diskblocks());
+   }
+   if(filecount < 0) {
+      closeDisk(mount);
+      mount = INVALID;
+      return READ_ERROR;
+   }
+   mountreadonly = readonly;
+   if(!readonly) {
+      // Other processes may write an image mounted read-only, so only
+      // read-write mounts keep its metadata
+      if((error = startMetaCache(mount)) != 0) {
+         closeDisk(mount);
+         mount = INVALID;
+         return error;
+      }
+      super[STATE_INDEX] = FS_DIRTY;
+      if(writeCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0) {
+         stopMetaCache();
+         closeDisk(mount);
+         mount = INVALID;
+         return WRITE_ERROR;
+      }
+      syncalloc();
+   }
 
    initFD();
+   memset(snapshots, NULL_ADDR, MAX_NUM_SNAPSHOTS);
+   defragnext = 0;
 
    return mount;
 }
 
-int tfs_unmount(void) {
+int tfs_mount(char *filename) {
+   uint64_t start = traceBegin();
+   int result = mountfs(filename, FALSE);
+
+   traceEnd(TRACE_MOUNT, start, -1, NULL, 0, 0, result);
+   return result;
+}
+
+int tfs_mountReadOnly(char *filename) {
+   uint64_t start = traceBegin();
+   int result = mountfs(filename, TRUE);
+
+   traceEnd(TRACE_MOUNT_READ_ONLY, start, -1, NULL, 0, 0, result);
+   return result;
+}
+
+static int unmountfs(void) {
+   uchar super[BLOCKSIZE];
+   int FD;
+
    if(mount == INVALID)
       return DISK_CLOSE_FAILURE;
+   for(FD = 0; FD < MAX_NUM_FILES; FD++) {
+      if(table[FD].valid == VALID) {
+         flushFD(FD);
+         releaseFD(FD);
+      }
+   }
+   // Everything is on disk, so the next mount can skip checkfs()
+   if(!mountreadonly && readCheckedBlock(mount, SUPERBLOCK_ADDR, super) == 0) {
+      super[STATE_INDEX] = FS_CLEAN;
+      store16(super + FREE_COUNT_INDEX, allocFreeCount());
+      store16(super + FILE_COUNT_INDEX, filecount);
+      writeCheckedBlock(mount, SUPERBLOCK_ADDR, super);
+   }
+   stopMetaCache();
    closeDisk(mount);
    mount = INVALID;
+   mountreadonly = FALSE;
    
    return 0;
 }
 
-fileDescriptor tfs_openFile(char *name) {
-   fileDescriptor file;
-   int inodenum = 0;
-   int i = 0;
+int tfs_unmount(void) {
+   uint64_t start = traceBegin();
+   int result = unmountfs();
 
-   while (i < MAX_NUM_FILES) {
-      if (table[i].valid == VALID && table[i].name == name){
-         file = i;
-         break;
-      }
-      i++;
-   }
-   file = i;
-   if (file == MAX_NUM_FILES) {
-      file = createFile(name);
-   }
-   inodenum = getInodeBlock(name, mount);
-   updateTime(inodenum, CREATED);
-   updateTime(inodenum, MODIFIED);
-   updateTime(inodenum, ACCESSED);
-   return file;
+   traceEnd(TRACE_UNMOUNT, start, -1, NULL, 0, 0, result);
+   return result;
 }
 
+static fileDescriptor openfile(char *name) {
+   uchar inode[BLOCKSIZE];
+   fileDescriptor file;
+   int inodenum;
 
+   if (mount == INVALID)
+      return OPEN_FAILURE;
 
-int tfs_closeFile(fileDescriptor FD) {
-   table[FD].valid = INVALID;
-   return 0;
-}
+   file = findFD(name);
+   if (file >= 0)
+      return file;
+   if (freefd < 0)
+      return ROOT_DIRECTORY_FULL;
+
+   if (mountreadonly) {
+      // Read-only mounts neither create files nor stamp them
+      inodenum = indexlookup(name);
+      if (inodenum < 0 || readCheckedBlock(mount, inodenum, inode) != 0)
+         return inodenum < 0 ? inodenum : READ_ERROR;
+      return allocFD(name, inode[2], ROOT_ADDR, inodenum, getFileSize(inode));
+   }
+
+   inodenum = getInodeBlock(name, mount);
+   if (inodenum == FILE_NOT_FOUND)
+      return createFile(name);
+   if (inodenum < 0 || readCheckedBlock(mount, inodenum, inode) != 0)
+      return READ_ERROR;
+
+   putstamp(inode, ACCESS_INDEX, time(NULL));
+   if (writeCheckedBlock(mount, inodenum, inode) != 0)
+      return WRITE_ERROR;
+   return allocFD(name, inode[2], ROOT_ADDR, inodenum, getFileSize(inode));
+}
+
+fileDescriptor tfs_openFile(char *name) {
+   uint64_t start = traceBegin();
+   fileDescriptor result = openfile(name);
+
+   traceEnd(TRACE_OPEN, start, -1, name, 0, 0, result);
+   return result;
+}
+
+static int closefile(fileDescriptor FD) {
+   int error;
+
+   if (!validFD(FD))
+      return FILE_NOT_FOUND;
+   error = flushFD(FD);
+   releaseFD(FD);
+   return error;
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+   uint64_t start = traceBegin();
+   int result = closefile(FD);
+
+   traceEnd(TRACE_CLOSE, start, FD, NULL, 0, 0, result);
+   return result;
+}
 
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {   
-   uchar data[BLOCKSIZE] = {0};
-   uchar bitmap[BITMAP_SIZE] = {0};
-   uchar inode[BLOCKSIZE] = {0};
-   char towrite[BLOCKSIZE] = {0};
-   int inodeblock = getInodeBlock(table[FD].name, mount);
+static int writefile(fileDescriptor FD, char *buffer, int size) {
+   uchar data[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar inode[BLOCKSIZE];
+   uchar oldblocks[MAX_NUM_BLOCKS];
+   uchar newblocks[MAX_NUM_BLOCKS];
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   uchar map[MAX_FILE_BLOCKS];
+   char towrite[DATA_SIZE] = {0};
+   int inodeblock;
    int errorCheck;
-   int writes = (size - 1)/DATA_SIZE + 1;
-   int blocks = writes;
+   int writes = fileblocks(size);
    int blocksused;
-   int freeblocksneeded;
+   int materialized;
+   int reusable = 0;
    int i = 0;
    int copy;
-   int currentblock;
+   int got;
    int nextblockaddr;
-   int tempsize = size;
 
 
-   if (table[FD].valid == INVALID)
+   if (!validFD(FD))
       return WRITE_ERROR;
+   if (table[FD].readonly)
+      return READ_ONLY_FS;
+   if (size < 0)
+      return WRITE_ERROR;
+   if (writes > MAX_FILE_BLOCKS)
+      return FILE_TOO_LARGE;
 
-   updateTime(inodeblock, ACCESSED);
-   
-   readBlock(mount, inodeblock, inode);
-   blocksused = inode[12];
-
-   inode[12] = blocks;
-   if(isLEndian())
-      tempsize = SWAP_ENDIAN_INT(tempsize);
-   memcpy(inode + 13, &tempsize, 4);
-
-   freeblocksneeded = blocks - blocksused;
-   if(freeblocksneeded > 0) {
-      if(nextFreeBlock(mount, freeblocksneeded - 1) == ROOT_DIRECTORY_FULL) {
-         fprintf(stderr, "Could not guarantee enough space for data\n");
-         return ROOT_DIRECTORY_FULL;
-      }
-   }
-
-
-   currentblock = inode[2];
+   inodeblock = fdinode(FD);
+   if (readCheckedBlock(mount, inodeblock, inode) != 0)
+      return READ_ERROR;
+   blocksused = readchain(inode, oldblocks);
+   if (blocksused < 0)
+      return READ_ERROR;
 
-   getBitmap(mount, bitmap);
-   while (writes > 0) {
-      setBitmap(bitmap, currentblock, USED);
+   // Release the old chain. Blocks a snapshot still references
+   // can't be overwritten, so only the rest are reused
+   if (getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return READ_ERROR;
+   for (i = 0; i < blocksused; i++) {
+      setBitmap(bitmap, oldblocks[i], FREE);
+      if (!blockinuse(held, oldblocks[i]))
+         oldblocks[reusable++] = oldblocks[i];
+   }
 
-      if(!blocksused--) {
-         if(writes != 1) {
-            nextblockaddr = nextFreeBlock(mount, i++);
-            assert(nextblockaddr != ROOT_DIRECTORY_FULL);
-         }
-         else
-            nextblockaddr = NULL_ADDR;
-      }
-      else {
-         readBlock(mount, currentblock, data);
-         if(blocksused) {
-            nextblockaddr = data[2];
-         }
-         else
-            nextblockaddr = nextFreeBlock(mount, i++);
-      }
+   materialized = markholes(buffer, size, map);
+   if (materialized > MAX_NUM_BLOCKS)
+      return ROOT_DIRECTORY_FULL;
 
-      if(size < DATA_SIZE)
-         copy = size;
+   // Pick every block before writing, so a full disk leaves the file intact
+   if (materialized > reusable && allocFreeCount() < materialized - reusable) {
+      fprintf(stderr, "Could not guarantee enough space for data\n");
+      return ROOT_DIRECTORY_FULL;
+   }
+   if (checkquota(load16(inode + FILE_QUOTA_INDEX), blocksused, materialized,
+                  materialized - reusable) != 0)
+      return QUOTA_EXCEEDED;
+   for (i = 0; i < materialized && i < reusable; i++)
+      newblocks[i] = oldblocks[i];
+   // New blocks come in runs placed right after the previous block
+   while (i < materialized) {
+      nextblockaddr = allocExtent(i ? newblocks[i - 1] + 1 : inodeblock + 1,
+                                  materialized - i, &got);
+      while (got--)
+         newblocks[i++] = nextblockaddr++;
+   }
+   for (i = 0; i < materialized; i++)
+      setBitmap(bitmap, newblocks[i], USED);
+
+   for (i = 0, copy = 0; i < writes; i++) {
+      if (map[i] == NULL_ADDR)
+         continue;
+      map[i] = newblocks[copy++];
+      if (copy < materialized)
+         nextblockaddr = newblocks[copy];
       else
-         copy = DATA_SIZE;
-      memcpy(towrite, buffer, copy);
+         nextblockaddr = NULL_ADDR;
+
+      memcpy(towrite, buffer + i * DATA_SIZE,
+             size - i * DATA_SIZE < DATA_SIZE ? size - i * DATA_SIZE : DATA_SIZE);
       makedatablock(nextblockaddr, (uchar *)towrite, data);
-      memset(towrite, 0x00, BLOCKSIZE);
-      buffer += copy;
-      size -= copy;
+      memset(towrite, 0x00, DATA_SIZE);
 
-      errorCheck = writeBlock(mount, currentblock, data);
+      errorCheck = writeCheckedBlock(mount, map[i], data);
       if (errorCheck == WRITE_ERROR || errorCheck == OPEN_FAILURE
-          || errorCheck == CLOSED_DISK_FAILURE)
+          || errorCheck == CLOSED_DISK_FAILURE) {
+         syncalloc();
          return errorCheck;
+      }
+   }
 
-      writes--;
-      currentblock = nextblockaddr;
+   // Old blocks the file no longer needs are free once the bitmap says so
+   for (i = materialized; i < reusable; i++) {
+      allocMark(oldblocks[i], 1, FREE);
+      freed[oldblocks[i]] = TRUE;
    }
-   updateBitmap(bitmap);
+
+   errorCheck = updateBitmap(bitmap);
+   if (errorCheck) {
+      syncalloc();
+      return errorCheck;
+   }
+   discardruns(freed);
    // Set file pointer to 0
    table[FD].pos = 0;
+   table[FD].blocknum = map[0];
+   table[FD].current_block = map[0];
+   table[FD].size = size;
+   table[FD].accessed = 0;
+   setmap(FD, map, writes);
+
+   inode[2] = materialized ? newblocks[0] : NULL_ADDR;
+   inode[3] = materialized ? VALID : INVALID;
+   inode[BLOCKS_INDEX] = materialized;
+   putFileSize(inode, size);
+   storeholes(inode, map, writes);
+   // Both timestamps go out with the inode
+   putstamp(inode, ACCESS_INDEX, time(NULL));
+   putstamp(inode, MOD_INDEX, time(NULL));
+   return writeCheckedBlock(mount, inodeblock, inode);
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+   uint64_t start = traceBegin();
+   int result = writefile(FD, buffer, size);
 
-   writeBlock(mount, inodeblock, inode);
-   updateTime(inodeblock, MODIFIED);
+   traceEnd(TRACE_WRITE, start, FD, NULL, 0, size, result);
+   return result;
+}
+
+static int writebegin(fileDescriptor FD) {
+   uchar inode[BLOCKSIZE];
+   tstream *stream;
 
+   if (!validFD(FD) || table[FD].stream)
+      return OPEN_FAILURE;
+   if (table[FD].readonly)
+      return READ_ONLY_FS;
+   if (readCheckedBlock(mount, fdinode(FD), inode) != 0)
+      return READ_ERROR;
+   if ((stream = calloc(1, sizeof(tstream))) == NULL)
+      return WRITE_ERROR;
+   stream->pending = -1;
+   stream->quota = load16(inode + FILE_QUOTA_INDEX);
+   stream->oldblocks = inode[BLOCKS_INDEX];
+   table[FD].stream = stream;
    return 0;
 }
 
-int tfs_deleteFile(fileDescriptor FD) {
-   uchar bitmap[BLOCKSIZE];
+/* Writes the pending block of a stream, chained to next */
+static int flushpending(tstream *stream, uchar next) {
    uchar block[BLOCKSIZE];
-   uchar blank[BLOCKSIZE];
-   uchar currentblock = getInodeBlock(table[FD].name, mount);
-   uchar nextblock;
-   int valid = VALID; 
-   int index = getrootindex(currentblock);
-   
-   if(index == FILE_NOT_FOUND)
-      return FILE_NOT_FOUND;
-   
-   makefreeblock(blank);
-   getBitmap(mount, bitmap);
+   int logical = stream->pending;
+
+   if (logical < 0)
+      return 0;
+   stream->pending = -1;
+   makedatablock(next, (uchar *)stream->pendingdata, block);
+   return writeCheckedBlock(mount, stream->map[logical], block);
+}
 
-   while(currentblock != NULL_ADDR && valid == VALID) {
-      readBlock(mount, currentblock, block);
-      nextblock = block[2];
-      valid = block[3];
-      setBitmap(bitmap, currentblock, FREE);
-      writeBlock(mount, currentblock, blank);
-      currentblock = nextblock;
+/* Ends the block being filled, zero padded, as the next logical block of the
+   stream. It becomes a hole if it is all zeros and the inode has room for the
+   hole, otherwise it gets a block right after the last one and becomes the
+   pending block */
+static int streamblock(fileDescriptor FD, tstream *stream) {
+   static const char zero[DATA_SIZE];
+   int logical = stream->nlogical;
+   int hint = stream->pending >= 0 ? stream->map[stream->pending] + 1
+                                   : fdinode(FD) + 1;
+   int addr;
+   int got;
+   int error;
+
+   if (logical >= MAX_FILE_BLOCKS)
+      return FILE_TOO_LARGE;
+   memset(stream->data + stream->used, 0, DATA_SIZE - stream->used);
+   if (!memcmp(stream->data, zero, DATA_SIZE) &&
+       ((logical && stream->map[logical - 1] == NULL_ADDR) ||
+        stream->holes < MAX_NUM_HOLES)) {
+      if (!logical || stream->map[logical - 1] != NULL_ADDR)
+         stream->holes++;
+      stream->map[logical] = NULL_ADDR;
    }
-   
-   updateBitmap(bitmap);
-   
-   updateroot(NULL_ADDR, index);
+   else {
+      if (allocFreeCount() < 1)
+         return ROOT_DIRECTORY_FULL;
+      if (checkquota(stream->quota, stream->oldblocks,
+                     stream->materialized + 1, 1) != 0)
+         return QUOTA_EXCEEDED;
+      addr = allocExtent(hint, 1, &got);
+      if (addr < 0)
+         return addr;
+      stream->map[logical] = addr;
+      if ((error = flushpending(stream, addr)) != 0) {
+         allocMark(addr, 1, FREE);
+         stream->map[logical] = NULL_ADDR;
+         return error;
+      }
+      memcpy(stream->pendingdata, stream->data, DATA_SIZE);
+      stream->pending = logical;
+      stream->materialized++;
+   }
+   stream->nlogical++;
+   stream->used = 0;
+   return 0;
+}
+
+static int writechunk(fileDescriptor FD, char *buffer, int size) {
+   tstream *stream;
+   int copy;
+   int error;
+
+   if (!validFD(FD) || !table[FD].stream)
+      return OPEN_FAILURE;
+   if (size < 0)
+      return WRITE_ERROR;
+   stream = table[FD].stream;
+
+   // A block only ends once a byte past it arrives, so the last one is
+   // still in memory at the commit
+   while (size > 0) {
+      if (stream->used == DATA_SIZE && (error = streamblock(FD, stream)) != 0) {
+         dropstream(FD);
+         return error;
+      }
+      copy = DATA_SIZE - stream->used < size ? DATA_SIZE - stream->used : size;
+      memcpy(stream->data + stream->used, buffer, copy);
+      stream->used += copy;
+      stream->size += copy;
+      buffer += copy;
+      size -= copy;
+   }
+   return 0;
+}
+
+static int writecommit(fileDescriptor FD) {
+   uchar inode[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar chain[MAX_NUM_BLOCKS];
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   tstream *stream;
+   int inodeblock;
+   int logical;
+   int count = 0;
+   int first = NULL_ADDR;
+   int error = 0;
+
+   if (!validFD(FD) || !table[FD].stream)
+      return OPEN_FAILURE;
+   stream = table[FD].stream;
+   inodeblock = fdinode(FD);
+
+   if (stream->used)
+      error = streamblock(FD, stream);
+   if (!error)
+      error = flushpending(stream, NULL_ADDR);
+   if (!error && readCheckedBlock(mount, inodeblock, inode) != 0)
+      error = READ_ERROR;
+   if (!error && (count = readchain(inode, chain)) < 0)
+      error = READ_ERROR;
+   if (!error && (getBitmap(mount, bitmap) || getHeldBitmap(mount, held)))
+      error = READ_ERROR;
+   if (error) {
+      dropstream(FD);
+      return error;
+   }
+
+   // The new version is marked in use before the inode points at it, and
+   // the old one freed only after, so a crash in between leaks one of the two
+   for (logical = 0; logical < stream->nlogical; logical++) {
+      if (stream->map[logical] == NULL_ADDR)
+         continue;
+      if (first == NULL_ADDR)
+         first = stream->map[logical];
+      setBitmap(bitmap, stream->map[logical], USED);
+   }
+   if ((error = updateBitmap(bitmap)) != 0) {
+      dropstream(FD);
+      syncalloc();
+      return error;
+   }
+
+   inode[2] = first;
+   inode[3] = first != NULL_ADDR ? VALID : INVALID;
+   inode[BLOCKS_INDEX] = stream->materialized;
+   putFileSize(inode, stream->size);
+   storeholes(inode, stream->map, stream->nlogical);
+   // Both timestamps go out with the inode
+   putstamp(inode, ACCESS_INDEX, time(NULL));
+   putstamp(inode, MOD_INDEX, time(NULL));
+   if ((error = writeCheckedBlock(mount, inodeblock, inode)) != 0) {
+      free(stream);
+      table[FD].stream = NULL;
+      syncalloc();
+      return error;
+   }
+
+   while (count-- > 0) {
+      setBitmap(bitmap, chain[count], FREE);
+      if (!blockinuse(held, chain[count])) {
+         allocMark(chain[count], 1, FREE);
+         freed[chain[count]] = TRUE;
+      }
+   }
+   error = updateBitmap(bitmap);
+   if (error)
+      syncalloc();
+   else
+      discardruns(freed);
 
-   table[FD].blocknum = NULL_ADDR;
    table[FD].pos = 0;
-   table[FD].valid = INVALID;
-   memset(table[FD].name, '\0', MAX_NAME_SIZE + 1);
-   table[FD].current_block = NULL_ADDR;
+   table[FD].blocknum = first;
+   table[FD].current_block = first;
+   table[FD].size = stream->size;
+   table[FD].accessed = 0;
+   setmap(FD, stream->map, stream->nlogical);
+   free(stream);
+   table[FD].stream = NULL;
+   return error;
+}
 
+static int writeabort(fileDescriptor FD) {
+   if (!validFD(FD) || !table[FD].stream)
+      return OPEN_FAILURE;
+   dropstream(FD);
    return 0;
 }
 
-int tfs_readByte(fileDescriptor FD, char *buffer) {
+int tfs_writeBegin(fileDescriptor FD) {
+   uint64_t start = traceBegin();
+   int result = writebegin(FD);
+
+   traceEnd(TRACE_WRITE_BEGIN, start, FD, NULL, 0, 0, result);
+   return result;
+}
+
+int tfs_writeChunk(fileDescriptor FD, char *buffer, int size) {
+   uint64_t start = traceBegin();
+   int result = writechunk(FD, buffer, size);
+
+   traceEnd(TRACE_WRITE_CHUNK, start, FD, NULL, 0, size, result);
+   return result;
+}
+
+int tfs_writeCommit(fileDescriptor FD) {
+   uint64_t start = traceBegin();
+   int result = writecommit(FD);
+
+   traceEnd(TRACE_WRITE_COMMIT, start, FD, NULL, 0, 0, result);
+   return result;
+}
+
+int tfs_writeAbort(fileDescriptor FD) {
+   uint64_t start = traceBegin();
+   int result = writeabort(FD);
+
+   traceEnd(TRACE_WRITE_ABORT, start, FD, NULL, 0, 0, result);
+   return result;
+}
+
+static int readat(fileDescriptor FD, char *buffer, int size, int offset) {
+   uchar block[BLOCKSIZE];
+   uchar local[MAX_FILE_BLOCKS];
+   uchar *map;
+   int count;
+   int logical;
+   int within;
+   int chunk;
+   int done = 0;
+
+   if (!validFD(FD))
+      return READ_ERROR;
+   if (offset < 0 || size < 0)
+      return READ_ERROR;
+   if (offset >= table[FD].size)
+      return 0;
+   if (size > table[FD].size - offset)
+      size = table[FD].size - offset;
+
+   map = filemap(FD, local, &count);
+   if (!map)
+      return READ_ERROR;
+   while (done < size) {
+      logical = (offset + done) / DATA_SIZE;
+      within = (offset + done) % DATA_SIZE;
+      chunk = DATA_SIZE - within;
+      if (chunk > size - done)
+         chunk = size - done;
+
+      // Holes have no block and read as zeros
+      if (logical >= count || map[logical] == NULL_ADDR)
+         memset(buffer + done, 0, chunk);
+      else {
+         if (readCheckedBlock(mount, map[logical], block) != 0)
+            return READ_ERROR;
+         memcpy(buffer + done, block + 4 + within, chunk);
+      }
+      done += chunk;
+   }
+
+   if (!table[FD].readonly)
+      table[FD].accessed = time(NULL);
+   return done;
+}
+
+/* Writes the bytes of a tfs_writeAt that lands inside blocks the file
+   already owns, in place. Returns FALSE without writing anything if one of the
+   blocks is a hole or held by a snapshot */
+static int writeinplace(fileDescriptor FD, char *buffer, int size, int offset) {
+   uchar block[BLOCKSIZE];
+   uchar held[BITMAP_SIZE];
+   uchar local[MAX_FILE_BLOCKS];
+   uchar *map;
+   int count;
+   int logical;
+   int within;
+   int chunk;
+   int done;
+
+   map = filemap(FD, local, &count);
+   if (!map)
+      return READ_ERROR;
+   if (getHeldBitmap(mount, held))
+      return READ_ERROR;
+   for (logical = offset / DATA_SIZE; logical * DATA_SIZE < offset + size;
+        logical++) {
+      if (logical >= count || map[logical] == NULL_ADDR ||
+          blockinuse(held, map[logical]))
+         return FALSE;
+   }
+
+   for (done = 0; done < size; done += chunk) {
+      logical = (offset + done) / DATA_SIZE;
+      within = (offset + done) % DATA_SIZE;
+      chunk = DATA_SIZE - within;
+      if (chunk > size - done)
+         chunk = size - done;
+      if (readCheckedBlock(mount, map[logical], block) != 0)
+         return READ_ERROR;
+      memcpy(block + 4 + within, buffer + done, chunk);
+      if (writeCheckedBlock(mount, map[logical], block) != 0)
+         return WRITE_ERROR;
+   }
+
+   if (readCheckedBlock(mount, fdinode(FD), block) != 0)
+      return READ_ERROR;
+   putstamp(block, ACCESS_INDEX, time(NULL));
+   putstamp(block, MOD_INDEX, time(NULL));
+   table[FD].accessed = 0;
+   if (writeCheckedBlock(mount, fdinode(FD), block) != 0)
+      return WRITE_ERROR;
+   return TRUE;
+}
+
+static int writeat(fileDescriptor FD, char *buffer, int size, int offset) {
+   char *file;
+   int newsize;
+   int pos;
+   int error;
+
+   if (!validFD(FD))
+      return WRITE_ERROR;
+   if (table[FD].readonly)
+      return READ_ONLY_FS;
+   if (offset < 0 || size < 0)
+      return WRITE_ERROR;
+   // Checked without adding, so huge arguments can't overflow
+   if (size > MAX_FILE_BLOCKS * DATA_SIZE - offset)
+      return FILE_TOO_LARGE;
+   if (!size)
+      return 0;
+
+   if (offset + size <= table[FD].size) {
+      error = writeinplace(FD, buffer, size, offset);
+      if (error < 0)
+         return error;
+      if (error)
+         return size;
+   }
+
+   // Growing the file, filling a hole or writing a block a snapshot holds
+   // goes through a rewrite of the whole file
+   newsize = offset + size > table[FD].size ? offset + size : table[FD].size;
+   file = calloc(1, newsize);
+   if (!file)
+      return WRITE_ERROR;
+   error = readat(FD, file, table[FD].size, 0);
+   if (error >= 0) {
+      memcpy(file + offset, buffer, size);
+      pos = table[FD].pos;
+      error = writefile(FD, file, newsize);
+      if (!error)
+         error = moveFD(FD, pos);
+   }
+   free(file);
+   return error < 0 ? error : size;
+}
+
+int tfs_writeAt(fileDescriptor FD, char *buffer, int size, int offset) {
+   uint64_t start = traceBegin();
+   int result = writeat(FD, buffer, size, offset);
+
+   traceEnd(TRACE_WRITE_AT, start, FD, NULL, offset, size, result);
+   return result;
+}
+
+static int deletefile(fileDescriptor FD) {
+   uchar bitmap[BLOCKSIZE];
+   uchar held[BITMAP_SIZE];
+   uchar inode[BLOCKSIZE];
+   uchar chain[MAX_NUM_BLOCKS + 2];
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   int inodeblock;
+   int count;
+   int index;
+   int error;
+
+   if(!validFD(FD))
+      return FILE_NOT_FOUND;
+   if(table[FD].readonly)
+      return READ_ONLY_FS;
+
+   inodeblock = fdinode(FD);
+   index = getrootindex(inodeblock);
+   if(index < 0)
+      return index;
+
+   if(readCheckedBlock(mount, inodeblock, inode) != 0)
+      return READ_ERROR;
+   count = readchain(inode, chain + 1);
+   if(count < 0)
+      return READ_ERROR;
+   chain[0] = inodeblock;
+   if(inode[XATTR_BLOCK_INDEX] != NULL_ADDR)
+      chain[++count] = inode[XATTR_BLOCK_INDEX];
+   if(getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return READ_ERROR;
+
+   // The file is gone once the root drops it; a crash after that only
+   // leaks its blocks
+   if((error = updateroot(NULL_ADDR, index)) != 0)
+      return error;
+   releaseFD(FD);
+   filecount--;
+
+   // Only the bitmap is written, the blocks themselves are just discarded
+   for(index = 0; index <= count; index++) {
+      setBitmap(bitmap, chain[index], FREE);
+      // Snapshots keep their blocks until the snapshot is deleted
+      if(!blockinuse(held, chain[index])) {
+         allocMark(chain[index], 1, FREE);
+         freed[chain[index]] = TRUE;
+      }
+   }
+   if((error = updateBitmap(bitmap)) != 0) {
+      syncalloc();
+      return error;
+   }
+   discardruns(freed);
+
+   return 0;
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+   uint64_t start = traceBegin();
+   int result = deletefile(FD);
+
+   traceEnd(TRACE_DELETE, start, FD, NULL, 0, 0, result);
+   return result;
+}
+
+static int readbyte(fileDescriptor FD, char *buffer) {
    uchar block[BLOCKSIZE];
    long pos;
-     
-   // Read in block from file at blocknum
-   if (readBlock(mount, table[FD].current_block, block) != 0)
+
+   if (!validFD(FD))
       return READ_ERROR;
-	  
-   // Set position to offset within block
-   pos = table[FD].pos % DATA_SIZE + 4;
-   
-   // Copy single byte from block at offset to buffer
-   memcpy(buffer, block + pos, sizeof(char));
+   if (table[FD].pos >= table[FD].size)
+      return READ_ERROR;
+
+   // Holes have no block and read as zeros
+   if (table[FD].current_block == NULL_ADDR)
+      *buffer = 0;
+   else {
+      // Read in block from file at blocknum
+      if (readCheckedBlock(mount, table[FD].current_block, block) != 0)
+         return READ_ERROR;
+
+      // Set position to offset within block
+      pos = table[FD].pos % DATA_SIZE + 4;
 
-   updateTime(getInodeBlock(table[FD].name, mount), ACCESSED);
+      // Copy single byte from block at offset to buffer
+      memcpy(buffer, block + pos, sizeof(char));
+   }
+
+   // The inode gets the access time when the file is closed
+   if (!table[FD].readonly)
+      table[FD].accessed = time(NULL);
 
+   if (table[FD].pos + 1 < table[FD].size)
+      return moveFD(FD, table[FD].pos + 1);
+   table[FD].pos++;
    return 0;
 }
 
-int tfs_seek(fileDescriptor FD, int offset) {
-   int inode;
-   int offs = offset;
-   int filesize;
-   char block[BLOCKSIZE];
-   char inodeblock[BLOCKSIZE];
-   uchar cur_block;
-   
-   inode = getInodeBlock(table[FD].name, mount);
-   readBlock(mount, inode, inodeblock);
-   filesize = getFileSize((uchar *)inodeblock);
-   cur_block = table[FD].blocknum;
-   
-   if (FD >= MAX_NUM_FILES || table[FD].valid == INVALID || offset >= filesize)
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+   uint64_t start = traceBegin();
+   int result = readbyte(FD, buffer);
+
+   traceEnd(TRACE_READ_BYTE, start, FD, NULL, 0, 1, result);
+   return result;
+}
+
+static int seekfile(fileDescriptor FD, int offset) {
+   if (!validFD(FD))
       return SEEK_ERROR;
-   
-   // Check if offset is greater than block size
-   // if it is, traverse blocks until offset > DATA_SIZE
-   // and update table[FD].blocknum accordingly.
-   while (offset >= DATA_SIZE) {
-      offset-= DATA_SIZE;
-	  if (readBlock(mount, cur_block, block) != 0)
-		return READ_ERROR;
-	  cur_block = block[3];
-   }
-   table[FD].pos = offs;
-   table[FD].current_block = cur_block;
+   if (offset < 0 || offset >= table[FD].size)
+      return SEEK_ERROR;
+
+   return moveFD(FD, offset);
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+   uint64_t start = traceBegin();
+   int result = seekfile(FD, offset);
+
+   traceEnd(TRACE_SEEK, start, FD, NULL, offset, 0, result);
+   return result;
+}
+
+int tfs_readAt(fileDescriptor FD, char *buffer, int size, int offset) {
+   uint64_t start = traceBegin();
+   int result = readat(FD, buffer, size, offset);
+
+   traceEnd(TRACE_READ_AT, start, FD, NULL, offset, size, result);
+   return result;
+}
+
+static int truncatefile(fileDescriptor FD, int len) {
+   uchar inode[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar ondisk[BITMAP_SIZE];
+   uchar chain[MAX_NUM_BLOCKS];
+   uchar map[MAX_FILE_BLOCKS];
+   uchar fresh[MAX_NUM_BLOCKS] = {0};
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   int inodeblock;
+   int size;
+   int count;
+   int oldlogical;
+   int newlogical = fileblocks(len);
+   int logical;
+   int error = 0;
+
+   if (!validFD(FD))
+      return FILE_NOT_FOUND;
+   if (table[FD].readonly)
+      return READ_ONLY_FS;
+   if (len < 0)
+      return WRITE_ERROR;
+   if (newlogical > MAX_FILE_BLOCKS)
+      return FILE_TOO_LARGE;
+
+   inodeblock = fdinode(FD);
+   if (readCheckedBlock(mount, inodeblock, inode) != 0)
+      return READ_ERROR;
+   size = getFileSize(inode);
+   oldlogical = fileblocks(size);
+   count = readchain(inode, chain);
+   if (count < 0)
+      return READ_ERROR;
+   buildmap(inode, chain, count, map, oldlogical);
+   if (getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return READ_ERROR;
+   memcpy(ondisk, bitmap, BITMAP_SIZE);
+
+   if (len < size) {
+      // Blocks past the new end are only dropped from the bitmap
+      for (logical = newlogical; logical < oldlogical; logical++) {
+         if (map[logical] == NULL_ADDR)
+            continue;
+         setBitmap(bitmap, map[logical], FREE);
+         if (!blockinuse(held, map[logical])) {
+            allocMark(map[logical], 1, FREE);
+            freed[map[logical]] = TRUE;
+         }
+      }
+   }
+   else if (len > size) {
+      // Growing adds a hole, or zero blocks if the inode has no room for one
+      memset(map + oldlogical, NULL_ADDR, newlogical - oldlogical);
+      if (countholes(map, newlogical) > MAX_NUM_HOLES) {
+         if (allocFreeCount() < newlogical - oldlogical)
+            return ROOT_DIRECTORY_FULL;
+         if (checkquota(load16(inode + FILE_QUOTA_INDEX), count,
+                        count + newlogical - oldlogical, newlogical - oldlogical))
+            return QUOTA_EXCEEDED;
+      }
+      error = zerotail(map, size, bitmap, held);
+      if (!error && countholes(map, newlogical) > MAX_NUM_HOLES)
+         error = fillholes(map, oldlogical, newlogical, fresh, bitmap, inodeblock + 1);
+   }
+
+   if (!error)
+      error = writechain(inode, chain, count, map, newlogical, fresh, bitmap,
+                         held, ondisk);
+   if (error) {
+      syncalloc();
+      return error;
+   }
+   // The blocks taken are already in use on disk, and the ones let go are
+   // freed only once the inode no longer points at them
+   putFileSize(inode, len);
+   putstamp(inode, MOD_INDEX, time(NULL));
+   error = writeCheckedBlock(mount, inodeblock, inode);
+   if (!error)
+      error = updateBitmap(bitmap);
+   if (error) {
+      syncalloc();
+      return error;
+   }
+   discardruns(freed);
+   refreshfds(table[FD].name, map, newlogical, len);
+
    return 0;
 }
 
-int tfs_rename(fileDescriptor file, char *name) {
+int tfs_truncate(fileDescriptor FD, int len) {
+   uint64_t start = traceBegin();
+   int result = truncatefile(FD, len);
+
+   traceEnd(TRACE_TRUNCATE, start, FD, NULL, 0, len, result);
+   return result;
+}
+
+static int fallocatefile(fileDescriptor FD, int offset, int len) {
+   uchar inode[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar ondisk[BITMAP_SIZE];
+   uchar chain[MAX_NUM_BLOCKS];
+   uchar map[MAX_FILE_BLOCKS];
+   uchar plan[MAX_FILE_BLOCKS];
+   uchar fresh[MAX_NUM_BLOCKS] = {0};
+   int inodeblock;
+   int size;
+   int newsize;
+   int count;
+   int oldlogical;
+   int newlogical;
+   int first = offset / DATA_SIZE;
+   int last;
+   int logical;
+   int needed = 0;
+   int error = 0;
+
+   if (!validFD(FD))
+      return FILE_NOT_FOUND;
+   if (table[FD].readonly)
+      return READ_ONLY_FS;
+   if (offset < 0 || len <= 0)
+      return WRITE_ERROR;
+   // Checked without adding, so huge arguments can't overflow
+   if (len > MAX_FILE_BLOCKS * DATA_SIZE - offset)
+      return FILE_TOO_LARGE;
+   last = fileblocks(offset + len);
+
+   inodeblock = fdinode(FD);
+   if (readCheckedBlock(mount, inodeblock, inode) != 0)
+      return READ_ERROR;
+   size = getFileSize(inode);
+   newsize = offset + len > size ? offset + len : size;
+   oldlogical = fileblocks(size);
+   newlogical = fileblocks(newsize);
+   count = readchain(inode, chain);
+   if (count < 0)
+      return READ_ERROR;
+   buildmap(inode, chain, count, map, oldlogical);
+   memset(map + oldlogical, NULL_ADDR, newlogical - oldlogical);
+   if (getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return READ_ERROR;
+   memcpy(ondisk, bitmap, BITMAP_SIZE);
+
+   // Filling part of a hole splits it; if the inode can't record the extra
+   // hole, fill every hole the range touches instead
+   memcpy(plan, map, newlogical);
+   memset(plan + first, TRUE, last - first);
+   if (countholes(plan, newlogical) > MAX_NUM_HOLES) {
+      while (first > 0 && map[first - 1] == NULL_ADDR)
+         first--;
+      while (last < newlogical && map[last] == NULL_ADDR)
+         last++;
+   }
+   for (logical = first; logical < last; logical++)
+      needed += map[logical] == NULL_ADDR;
+   if (allocFreeCount() < needed)
+      return ROOT_DIRECTORY_FULL;
+   if (checkquota(load16(inode + FILE_QUOTA_INDEX), count, count + needed, needed))
+      return QUOTA_EXCEEDED;
+
+   if (newsize > size)
+      error = zerotail(map, size, bitmap, held);
+   if (!error)
+      error = fillholes(map, first, last, fresh, bitmap, inodeblock + 1);
+   if (!error)
+      error = writechain(inode, chain, count, map, newlogical, fresh, bitmap,
+                         held, ondisk);
+   if (error) {
+      syncalloc();
+      return error;
+   }
+   // Like tfs_truncate, the new blocks are in use on disk before the inode
+   // points at them
+   putFileSize(inode, newsize);
+   putstamp(inode, MOD_INDEX, time(NULL));
+   error = writeCheckedBlock(mount, inodeblock, inode);
+   if (!error)
+      error = updateBitmap(bitmap);
+   if (error) {
+      syncalloc();
+      return error;
+   }
+   refreshfds(table[FD].name, map, newlogical, newsize);
+
+   return 0;
+}
+
+int tfs_fallocate(fileDescriptor FD, int offset, int len) {
+   uint64_t start = traceBegin();
+   int result = fallocatefile(FD, offset, len);
+
+   traceEnd(TRACE_FALLOCATE, start, FD, NULL, offset, len, result);
+   return result;
+}
+
+static int renamefile(fileDescriptor file, char *name) {
    int inode;
-   uchar block[BLOCKSIZE] = {0};
+   uchar block[BLOCKSIZE];
 
-   if (table[file].valid == INVALID)
+   if (!validFD(file))
       return FILE_NOT_FOUND;
+   if (table[file].readonly)
+      return READ_ONLY_FS;
 
-   inode = getInodeBlock(table[file].name, mount);
-   if (readBlock(mount, inode, block) != 0)
+   inode = fdinode(file);
+   if (readCheckedBlock(mount, inode, block) != 0)
       return READ_ERROR;
-   strncpy(block + 4, name, MAX_NAME_SIZE);
-   strncpy(table[file].name, name, MAX_NAME_SIZE);
-   writeBlock(mount, inode, block);
+   strncpy((char *)block + NAME_INDEX, name, MAX_NAME_SIZE);
+   putstamp(block, MOD_INDEX, time(NULL));
+   putstamp(block, ACCESS_INDEX, time(NULL));
+   if (writeCheckedBlock(mount, inode, block) != 0)
+      return WRITE_ERROR;
 
-   updateTime(inode, MODIFIED);
-   updateTime(inode, ACCESSED);
+   // The descriptor moves to the bucket of its new name
+   unhashFD(file);
+   memset(table[file].name, '\0', MAX_NAME_SIZE + 1);
+   strncpy(table[file].name, name, MAX_NAME_SIZE);
+   hashFD(file);
+   table[file].accessed = 0;
 
    return 0;
 }
 
+int tfs_rename(fileDescriptor file, char *name) {
+   uint64_t start = traceBegin();
+   int result = renamefile(file, name);
+
+   traceEnd(TRACE_RENAME, start, file, name, 0, 0, result);
+   return result;
+}
+
+static void fillstat(uchar *inode, uchar inodeblock, tstat *stat) {
+   tinode ino;
+
+   decodeinode(inode, &ino);
+   memset(stat, 0, sizeof(tstat));
+   strncpy(stat->name, (char *)inode + NAME_INDEX, MAX_NAME_SIZE);
+   stat->size = ino.size;
+   stat->blocks = ino.blocks;
+   stat->quota = ino.quota;
+   stat->inode = inodeblock;
+   stat->created = ino.created;
+   stat->modified = ino.modified;
+   stat->accessed = ino.accessed;
+}
+
 int tfs_readdir() {
-   int rootndx;
-   int loop = ROOT_FIRST_ADDR;
-   uchar inode = 0;
-   uchar block[BLOCKSIZE] = {0};
-   uchar inodeblock[BLOCKSIZE] = {0};
-   char name[9] = {0};
+   tdir dir;
+   tstat stats[MAX_NUM_FILES];
+   int count;
+   int i;
 
    printf("root (dir)\n");
-   
-   if (readBlock(mount, ROOT_ADDR, block) != 0)
-      return READ_ERROR;
 
-   while (loop < BLOCKSIZE) {
-      inode = block[loop];
-      if (inode) {
-         if (readBlock(mount, inode, inodeblock) != 0)
-            return READ_ERROR;
-         strncpy(name, inodeblock + 4, MAX_NAME_SIZE);
-         printf("  %s (file)", name);
-      }
-      loop++;
+   if (tfs_openDir(&dir) != 0)
+      return READ_ERROR;
+   while ((count = tfs_readDirEntries(&dir, stats, MAX_NUM_FILES)) > 0) {
+      for (i = 0; i < count; i++)
+         printf("  %s (file)", stats[i].name);
    }
    printf("\n");
-   return 0;
+   return count;
 }
 
 void tfs_readFileInfo(fileDescriptor FD) {
-   int inode = getInodeBlock(table[FD].name, mount);
-   time_t rawcreated = getTime(inode, CREATED);
-   time_t rawmod = getTime(inode, MODIFIED);
-   time_t rawaccessed = getTime(inode, ACCESSED);
-   tm *created;
-   tm *mod;
-   tm *accessed;
-   char *str = NULL;
+   uchar inode[BLOCKSIZE];
+   int inodeblock = fdinode(FD);
+   tstat stat;
 
    printf("%s\n", table[FD].name);
+   if (inodeblock < 0 || readCheckedBlock(mount, inodeblock, inode) != 0)
+      return;
+   fillstat(inode, inodeblock, &stat);
+
+   printf("   Created: %s", asctime(localtime(&stat.created)));
+   printf("   Modified: %s", asctime(localtime(&stat.modified)));
+   printf("   Accessed: %s\n", asctime(localtime(&stat.accessed)));
+}
+
+int tfs_openDir(tdir *dir) {
+   uchar root[BLOCKSIZE];
 
-   created = localtime(&rawcreated);
-   str = asctime(created);
-   printf("   Created: %s", str);
+   if (mount == INVALID)
+      return OPEN_FAILURE;
+   if (readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   memcpy(dir->inodes, root + ROOT_FIRST_ADDR, MAX_NUM_FILES);
+   dir->next = 0;
+   return 0;
+}
 
-   mod = localtime(&rawmod);
-   str = asctime(mod);
-   printf("   Modified: %s", str);
+int tfs_readDirEntries(tdir *dir, tstat *stats, int max) {
+   uchar inode[BLOCKSIZE];
+   uchar addr;
+   int count = 0;
+
+   if (mount == INVALID)
+      return OPEN_FAILURE;
+   while (count < max && dir->next < MAX_NUM_FILES) {
+      addr = dir->inodes[dir->next++];
+      if (addr == NULL_ADDR)
+         continue;
+      if (readCheckedBlock(mount, addr, inode) != 0)
+         return READ_ERROR;
+      fillstat(inode, addr, &stats[count++]);
+   }
+   return count;
+}
+
+int tfs_statInode(int inode, tstat *stat) {
+   uchar block[BLOCKSIZE];
+
+   if (mount == INVALID)
+      return OPEN_FAILURE;
+   // The superblock and root are never files, and only inodes the root
+   // points at are live
+   if (inode <= ROOT_ADDR || inode >= MAX_NUM_BLOCKS ||
+       getrootindex(inode) < 0)
+      return FILE_NOT_FOUND;
+   if (readCheckedBlock(mount, inode, block) != 0)
+      return READ_ERROR;
+   fillstat(block, inode, stat);
+   return 0;
+}
+
+/* Looks up count names in one pass over the directory in rootblock, reading
+   each inode once. Fills stats for every name found and sets its inode to
+   NULL_ADDR for the rest; firsts, if not NULL, gets each file's first data
+   block. Returns the number of names found */
+static int findmany(uchar *rootblock, char **names, int count, tstat *stats,
+                    uchar *firsts) {
+   uchar inode[BLOCKSIZE];
+   int loop;
+   int i;
+   int found = 0;
+
+   for(i = 0; i < count; i++)
+      stats[i].inode = NULL_ADDR;
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX && found < count; loop++) {
+      if(rootblock[loop] == NULL_ADDR)
+         continue;
+      if(readCheckedBlock(mount, rootblock[loop], inode) != 0)
+         return READ_ERROR;
+      for(i = 0; i < count; i++) {
+         if(stats[i].inode != NULL_ADDR ||
+            strncmp(names[i], (char *)inode + NAME_INDEX, MAX_NAME_SIZE))
+            continue;
+         fillstat(inode, rootblock[loop], &stats[i]);
+         if(firsts)
+            firsts[i] = inode[2];
+         found++;
+      }
+   }
+   return found;
+}
+
+int tfs_createMany(char **names, int count, fileDescriptor *fds) {
+   uchar root[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   uchar zero[DATA_SIZE] = {0};
+   uchar bitmap[BITMAP_SIZE];
+   uchar firsts[MAX_NUM_FILES];
+   short sameas[MAX_NUM_FILES];
+   tstat stats[MAX_NUM_FILES];
+   time_t now = time(NULL);
+   int newfiles = 0;
+   int freeslots = 0;
+   int newfds = 0;
+   int slot = ROOT_FIRST_ADDR;
+   int inodeblock;
+   int got;
+   int i;
+   int j;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(count < 0)
+      return WRITE_ERROR;
+   if(count > MAX_NUM_FILES)
+      return ROOT_DIRECTORY_FULL;
+
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   if(findmany(root, names, count, stats, firsts) < 0)
+      return READ_ERROR;
+
+   // A name given twice is only created and opened once
+   for(i = 0; i < count; i++) {
+      sameas[i] = -1;
+      for(j = 0; j < i && sameas[i] < 0; j++) {
+         if(sameas[j] < 0 && !strncmp(names[i], names[j], MAX_NAME_SIZE))
+            sameas[i] = j;
+      }
+      if(sameas[i] >= 0)
+         continue;
+      newfiles += stats[i].inode == NULL_ADDR;
+      newfds += findFD(names[i]) < 0;
+   }
+
+   // Check everything fits before touching the disk
+   for(i = ROOT_FIRST_ADDR; i < CHECKSUM_INDEX; i++)
+      freeslots += root[i] == NULL_ADDR;
+   for(i = freefd; i >= 0 && newfds > 0; i = table[i].next)
+      newfds--;
+   if(newfiles > freeslots || newfds > 0 || allocFreeCount() < 2 * newfiles)
+      return ROOT_DIRECTORY_FULL;
+   if(checkquota(0, 0, 1, 2 * newfiles) != 0)
+      return QUOTA_EXCEEDED;
+
+   if(getBitmap(mount, bitmap))
+      return READ_ERROR;
+   for(i = 0; i < count; i++) {
+      if(stats[i].inode != NULL_ADDR || sameas[i] >= 0)
+         continue;
+      inodeblock = allocInode();
+      firsts[i] = allocExtent(inodeblock + 1, 1, &got);
+      setBitmap(bitmap, inodeblock, USED);
+      setBitmap(bitmap, firsts[i], USED);
+
+      makedatablock(NULL_ADDR, zero, block);
+      if(writeCheckedBlock(mount, firsts[i], block) != 0) {
+         syncalloc();
+         return WRITE_ERROR;
+      }
+      // Timestamps go in with the inode rather than as three more writes
+      makeinode(firsts[i], names[i], block, 0, 1);
+      putstamp(block, CREATION_INDEX, now);
+      putstamp(block, MOD_INDEX, now);
+      putstamp(block, ACCESS_INDEX, now);
+      if(writeCheckedBlock(mount, inodeblock, block) != 0) {
+         syncalloc();
+         return WRITE_ERROR;
+      }
+
+      while(root[slot] != NULL_ADDR)
+         slot++;
+      root[slot] = inodeblock;
+      stats[i].inode = inodeblock;
+      stats[i].size = 0;
+   }
+
+   // The bitmap goes first so a crash can only leak blocks, never
+   // leave the root pointing at free ones
+   if(updateBitmap(bitmap) != 0 ||
+      (newfiles && writeCheckedBlock(mount, ROOT_ADDR, root) != 0)) {
+      syncalloc();
+      return WRITE_ERROR;
+   }
+   filecount += newfiles;
+
+   for(i = 0; i < count; i++) {
+      fds[i] = findFD(names[i]);
+      if(fds[i] < 0)
+         fds[i] = allocFD(names[i], firsts[i], ROOT_ADDR, stats[i].inode, stats[i].size);
+   }
+   return 0;
+}
+
+int tfs_deleteMany(fileDescriptor *fds, int count) {
+   uchar root[BLOCKSIZE];
+   uchar inode[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar chain[MAX_NUM_BLOCKS];
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   int deleted = 0;
+   int inodeblock;
+   int blocks;
+   int loop;
+   int i;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(count < 0 || count > MAX_NUM_FILES)
+      return FILE_NOT_FOUND;
+   for(i = 0; i < count; i++) {
+      if(!validFD(fds[i]))
+         return FILE_NOT_FOUND;
+      if(table[fds[i]].readonly)
+         return READ_ONLY_FS;
+   }
+
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0 || getBitmap(mount, bitmap) ||
+      getHeldBitmap(mount, held))
+      return READ_ERROR;
+   for(i = 0; i < count; i++) {
+      inodeblock = fdinode(fds[i]);
+      // The same file may be in the batch twice
+      if(freed[inodeblock])
+         continue;
+      if(readCheckedBlock(mount, inodeblock, inode) != 0)
+         return READ_ERROR;
+      blocks = readchain(inode, chain);
+      if(blocks < 0)
+         return READ_ERROR;
+      freed[inodeblock] = TRUE;
+      if(inode[XATTR_BLOCK_INDEX] != NULL_ADDR)
+         freed[inode[XATTR_BLOCK_INDEX]] = TRUE;
+      deleted++;
+      while(blocks-- > 0)
+         freed[chain[blocks]] = TRUE;
+      for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++) {
+         if(root[loop] == inodeblock)
+            root[loop] = NULL_ADDR;
+      }
+   }
+
+   if(writeCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return WRITE_ERROR;
+   filecount -= deleted;
+   for(i = 0; i < count; i++) {
+      if(validFD(fds[i]))
+         releaseFD(fds[i]);
+   }
+   for(loop = 0; loop < MAX_NUM_BLOCKS; loop++) {
+      if(freed[loop])
+         setBitmap(bitmap, loop, FREE);
+   }
+   if(updateBitmap(bitmap) != 0)
+      return WRITE_ERROR;
+
+   // Snapshots keep their blocks until the snapshot is deleted
+   for(loop = 0; loop < MAX_NUM_BLOCKS; loop++) {
+      if(freed[loop] && blockinuse(held, loop))
+         freed[loop] = FALSE;
+      else if(freed[loop])
+         allocMark(loop, 1, FREE);
+   }
+   discardruns(freed);
+
+   return 0;
+}
+
+int tfs_statMany(char **names, int count, tstat *stats) {
+   uchar root[BLOCKSIZE];
+   int found;
+   int i;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(count < 0)
+      return FILE_NOT_FOUND;
+
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   found = findmany(root, names, count, stats, NULL);
+   if(found < 0)
+      return READ_ERROR;
+   if(found == count)
+      return 0;
+
+   for(i = 0; i < count; i++) {
+      if(stats[i].inode == NULL_ADDR)
+         memset(&stats[i], 0, sizeof(tstat));
+   }
+   return FILE_NOT_FOUND;
+}
+
+static int statfile(char *name, tstat *stat) {
+   uchar root[BLOCKSIZE];
+   int found;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly) {
+      found = indexlookup(name);
+      if(found < 0) {
+         memset(stat, 0, sizeof(tstat));
+         return FILE_NOT_FOUND;
+      }
+      if(readCheckedBlock(mount, found, root) != 0)
+         return READ_ERROR;
+      fillstat(root, found, stat);
+      return 0;
+   }
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   found = findmany(root, &name, 1, stat, NULL);
+   if(found < 0)
+      return READ_ERROR;
+   if(!found) {
+      memset(stat, 0, sizeof(tstat));
+      return FILE_NOT_FOUND;
+   }
+   return 0;
+}
+
+int tfs_stat(char *name, tstat *stat) {
+   uint64_t start = traceBegin();
+   int result = statfile(name, stat);
+
+   traceEnd(TRACE_STAT, start, -1, name, 0, 0, result);
+   return result;
+}
+
+int tfs_statfs(tstatfs *stat) {
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   stat->blocks = diskblocks();
+   stat->free = mountreadonly ? mountfree : allocFreeCount();
+   stat->files = filecount;
+   stat->freefiles = MAX_NUM_FILES - filecount;
+   stat->quota = rootquota;
+   return 0;
+}
+
+int tfs_setQuota(int blocks) {
+   uchar super[BLOCKSIZE];
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(blocks < 0)
+      return WRITE_ERROR;
+   if(readCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0)
+      return READ_ERROR;
+   store16(super + ROOT_QUOTA_INDEX, blocks < MAX_NUM_BLOCKS ? blocks : MAX_NUM_BLOCKS);
+   if(writeCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0)
+      return WRITE_ERROR;
+   rootquota = load16(super + ROOT_QUOTA_INDEX);
+   return 0;
+}
+
+int tfs_setFileQuota(fileDescriptor FD, int blocks) {
+   uchar inode[BLOCKSIZE];
+
+   if(!validFD(FD))
+      return FILE_NOT_FOUND;
+   if(table[FD].readonly)
+      return READ_ONLY_FS;
+   if(blocks < 0)
+      return WRITE_ERROR;
+   if(readCheckedBlock(mount, fdinode(FD), inode) != 0)
+      return READ_ERROR;
+   store16(inode + FILE_QUOTA_INDEX, blocks < MAX_NUM_BLOCKS ? blocks : MAX_NUM_BLOCKS);
+   return writeCheckedBlock(mount, fdinode(FD), inode);
+}
+
+static int xattrlen(uchar *entry) {
+   return 2 + entry[0] + entry[1];
+}
+
+/* Whether a whole entry starts at byte at of the size bytes at space */
+static int isxattr(uchar *space, int size, int at) {
+   return at + 2 <= size && space[at] && at + xattrlen(space + at) <= size;
+}
+
+static int samexattr(uchar *entry, char *name) {
+   return entry[0] == strlen(name) && !memcmp(entry + 2, name, entry[0]);
+}
+
+/* Returns the entry of attribute name in the size bytes of packed attributes
+   at space, or NULL if it is not there */
+static uchar *findxattr(uchar *space, int size, char *name) {
+   int at;
+
+   for(at = 0; isxattr(space, size, at); at += xattrlen(space + at)) {
+      if(samexattr(space + at, name))
+         return space + at;
+   }
+   return NULL;
+}
+
+/* Appends the entries packed in the size bytes at space to list, leaving out
+   attribute skip, and returns the new length of list */
+static int copyxattrs(uchar *space, int size, uchar *list, int used, char *skip) {
+   int at;
+
+   for(at = 0; isxattr(space, size, at); at += xattrlen(space + at)) {
+      if(samexattr(space + at, skip))
+         continue;
+      memcpy(list + used, space + at, xattrlen(space + at));
+      used += xattrlen(space + at);
+   }
+   return used;
+}
+
+/* Packs the used bytes of entries in list into the tail of inode, smallest
+   first, and the ones that don't fit into overflow. Returns the bytes of
+   overflow used, or FILE_TOO_LARGE if they don't fit either */
+static int packxattrs(uchar *list, int used, uchar *inode, uchar *overflow) {
+   uchar taken[XATTR_LIST_SIZE] = {0};
+   uchar *space = inode + XATTR_INDEX;
+   int room = XATTR_TAIL_SIZE;
+   int filled = 0;
+   int spilled = 0;
+   int smallest;
+   int at;
+
+   memset(space, 0, XATTR_TAIL_SIZE);
+   memset(overflow, 0, DATA_SIZE);
+   for(;;) {
+      smallest = -1;
+      for(at = 0; at < used; at += xattrlen(list + at)) {
+         if(!taken[at] && (smallest < 0 || xattrlen(list + at) < xattrlen(list + smallest)))
+            smallest = at;
+      }
+      if(smallest < 0)
+         return spilled;
+      taken[smallest] = TRUE;
+      // Past the first that doesn't fit inline, none will
+      if(filled + xattrlen(list + smallest) > room) {
+         room = filled;
+         if(spilled + xattrlen(list + smallest) > DATA_SIZE)
+            return FILE_TOO_LARGE;
+         memcpy(overflow + spilled, list + smallest, xattrlen(list + smallest));
+         spilled += xattrlen(list + smallest);
+      }
+      else {
+         memcpy(space + filled, list + smallest, xattrlen(list + smallest));
+         filled += xattrlen(list + smallest);
+      }
+   }
+}
+
+/* Reads the data of the overflow block of inode into overflow */
+static int readxattrblock(uchar *inode, uchar *overflow) {
+   uchar block[BLOCKSIZE];
+
+   memset(overflow, 0, DATA_SIZE);
+   if(inode[XATTR_BLOCK_INDEX] == NULL_ADDR)
+      return 0;
+   if(readCheckedBlock(mount, inode[XATTR_BLOCK_INDEX], block) != 0 ||
+      block[0] != XATTR_BLOCK)
+      return READ_ERROR;
+   memcpy(overflow, block + 4, DATA_SIZE);
+   return 0;
+}
+
+/* Rewrites the attributes of the file with inode inodeblock without
+   attribute name, plus name set to value if value isn't NULL */
+static int updatexattrs(uchar inodeblock, char *name, char *value, int size) {
+   uchar inode[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   uchar overflow[DATA_SIZE];
+   uchar list[XATTR_LIST_SIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar old;
+   int used;
+   int spilled;
+   int got;
+   int error;
+
+   if(readCheckedBlock(mount, inodeblock, inode) != 0 ||
+      readxattrblock(inode, overflow) != 0)
+      return READ_ERROR;
+   if(!value && !findxattr(inode + XATTR_INDEX, XATTR_TAIL_SIZE, name) &&
+      !findxattr(overflow, DATA_SIZE, name))
+      return FILE_NOT_FOUND;
+   used = copyxattrs(inode + XATTR_INDEX, XATTR_TAIL_SIZE, list, 0, name);
+   used = copyxattrs(overflow, DATA_SIZE, list, used, name);
+   if(value) {
+      list[used] = strlen(name);
+      list[used + 1] = size;
+      memcpy(list + used + 2, name, list[used]);
+      memcpy(list + used + 2 + list[used], value, size);
+      used += xattrlen(list + used);
+   }
+   // No packing fits more than the tail and the overflow block hold
+   if(used > (int)(XATTR_TAIL_SIZE + DATA_SIZE))
+      return FILE_TOO_LARGE;
+   spilled = packxattrs(list, used, inode, overflow);
+   if(spilled < 0)
+      return spilled;
+   if(getBitmap(mount, bitmap) || getHeldBitmap(mount, held))
+      return READ_ERROR;
+
+   // An overflow block a snapshot holds is copied rather than overwritten,
+   // and a new one is marked in use before the inode points at it
+   old = inode[XATTR_BLOCK_INDEX];
+   if(spilled && (old == NULL_ADDR || blockinuse(held, old))) {
+      if(allocFreeCount() < 1)
+         return ROOT_DIRECTORY_FULL;
+      if((error = checkquota(0, 0, 0, 1)) != 0)
+         return error;
+      inode[XATTR_BLOCK_INDEX] = allocExtent(inodeblock + 1, 1, &got);
+      setBitmap(bitmap, inode[XATTR_BLOCK_INDEX], USED);
+      if((error = updateBitmap(bitmap)) != 0) {
+         syncalloc();
+         return error;
+      }
+   }
+   else if(!spilled)
+      inode[XATTR_BLOCK_INDEX] = NULL_ADDR;
+   if(spilled) {
+      makedatablock(NULL_ADDR, overflow, block);
+      block[0] = XATTR_BLOCK;
+      if((error = writeCheckedBlock(mount, inode[XATTR_BLOCK_INDEX], block)) != 0)
+         return error;
+   }
+   if((error = writeCheckedBlock(mount, inodeblock, inode)) != 0)
+      return error;
+
+   // The old block is let go only once the inode no longer points at it
+   if(old != NULL_ADDR && old != inode[XATTR_BLOCK_INDEX]) {
+      setBitmap(bitmap, old, FREE);
+      if(!blockinuse(held, old))
+         allocMark(old, 1, FREE);
+      if((error = updateBitmap(bitmap)) != 0) {
+         syncalloc();
+         return error;
+      }
+      if(!blockinuse(held, old))
+         discardCheckedBlocks(mount, old, 1);
+   }
+   return 0;
+}
+
+static int checkxattrname(char *name) {
+   return name && name[0] && strlen(name) <= MAX_XATTR_NAME_SIZE;
+}
+
+int tfs_setxattr(fileDescriptor FD, char *name, char *value, int size) {
+   if(!validFD(FD))
+      return FILE_NOT_FOUND;
+   if(table[FD].readonly)
+      return READ_ONLY_FS;
+   if(!checkxattrname(name) || !value || size < 0)
+      return WRITE_ERROR;
+   if(size > MAX_XATTR_VALUE_SIZE)
+      return FILE_TOO_LARGE;
+   return updatexattrs(fdinode(FD), name, value, size);
+}
+
+int tfs_removexattr(fileDescriptor FD, char *name) {
+   if(!validFD(FD))
+      return FILE_NOT_FOUND;
+   if(table[FD].readonly)
+      return READ_ONLY_FS;
+   if(!checkxattrname(name))
+      return FILE_NOT_FOUND;
+   return updatexattrs(fdinode(FD), name, NULL, 0);
+}
+
+int tfs_getxattr(fileDescriptor FD, char *name, char *value, int size) {
+   uchar inode[BLOCKSIZE];
+   uchar overflow[DATA_SIZE];
+   uchar *entry;
+
+   if(!validFD(FD) || !checkxattrname(name))
+      return FILE_NOT_FOUND;
+   if(readCheckedBlock(mount, fdinode(FD), inode) != 0)
+      return READ_ERROR;
+   // Small attributes come with the inode, only large ones cost a read
+   entry = findxattr(inode + XATTR_INDEX, XATTR_TAIL_SIZE, name);
+   if(!entry) {
+      if(readxattrblock(inode, overflow) != 0)
+         return READ_ERROR;
+      entry = findxattr(overflow, DATA_SIZE, name);
+   }
+   if(!entry)
+      return FILE_NOT_FOUND;
+   if(size && entry[1] > size)
+      return FILE_TOO_LARGE;
+   if(size)
+      memcpy(value, entry + 2 + entry[0], entry[1]);
+   return entry[1];
+}
+
+int tfs_listxattr(fileDescriptor FD, char *list, int size) {
+   uchar inode[BLOCKSIZE];
+   uchar overflow[DATA_SIZE];
+   uchar *spaces[2];
+   int sizes[2] = {XATTR_TAIL_SIZE, DATA_SIZE};
+   int total = 0;
+   int space;
+   int at;
+
+   if(!validFD(FD))
+      return FILE_NOT_FOUND;
+   if(readCheckedBlock(mount, fdinode(FD), inode) != 0 ||
+      readxattrblock(inode, overflow) != 0)
+      return READ_ERROR;
+   spaces[0] = inode + XATTR_INDEX;
+   spaces[1] = overflow;
+   for(space = 0; space < 2; space++) {
+      for(at = 0; isxattr(spaces[space], sizes[space], at);
+          at += xattrlen(spaces[space] + at)) {
+         if(size && total + spaces[space][at] + 1 > size)
+            return FILE_TOO_LARGE;
+         if(size) {
+            memcpy(list + total, spaces[space] + at + 2, spaces[space][at]);
+            list[total + spaces[space][at]] = '\0';
+         }
+         total += spaces[space][at] + 1;
+      }
+   }
+   return total;
+}
+
+/* Returns the snapshot table slot holding name, or FILE_NOT_FOUND */
+static int findsnapshot(uchar *super, char *name) {
+   int slot;
+   uchar *entry;
+
+   for(slot = 0; slot < MAX_NUM_SNAPSHOTS; slot++) {
+      entry = super + SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE;
+      if(entry[0] != NULL_ADDR && !strncmp((char *)entry + 1, name, MAX_NAME_SIZE))
+         return slot;
+   }
+   return FILE_NOT_FOUND;
+}
+
+int tfs_snapshot(char *name) {
+   uchar super[BLOCKSIZE];
+   uchar root[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar snapmap[BITMAP_SIZE];
+   uchar *entry = NULL;
+   int slot;
+   int loop;
+   int needed = 2;
+   int snapsuper;
+   int snaproot;
+   int copy;
+   int got;
+   int error = 0;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(readCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0 ||
+      readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+   if(findsnapshot(super, name) != FILE_NOT_FOUND)
+      return OPEN_FAILURE;
+
+   for(slot = 0; slot < MAX_NUM_SNAPSHOTS && !entry; slot++) {
+      if(super[SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE] == NULL_ADDR)
+         entry = super + SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE;
+   }
+   if(!entry)
+      return ROOT_DIRECTORY_FULL;
+
+   memcpy(bitmap, super + BITMAP_FIRST_ADDR, BITMAP_SIZE);
+   memcpy(held, super + HELD_FIRST_ADDR, BITMAP_SIZE);
+
+   // The snapshot needs its own superblock, root and a copy of every inode
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++) {
+      if(root[loop])
+         needed++;
+   }
+   if(allocFreeCount() < needed)
+      return ROOT_DIRECTORY_FULL;
+   if(checkquota(0, 0, 0, needed) != 0)
+      return QUOTA_EXCEEDED;
+
+   // Snapshot references all live data blocks, but none of the live metadata
+   memcpy(snapmap, bitmap, BITMAP_SIZE);
+   setBitmap(snapmap, SUPERBLOCK_ADDR, FREE);
+   setBitmap(snapmap, ROOT_ADDR, FREE);
+
+   snapsuper = allocExtent(SUPERBLOCK_ADDR, 1, &got);
+   snaproot = allocExtent(snapsuper + 1, 1, &got);
+   setBitmap(snapmap, snapsuper, USED);
+   setBitmap(snapmap, snaproot, USED);
+
+   // Until the table entry is published the copies are in no bitmap, so on
+   // a failure giving the blocks back to the tree is all that's needed
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX && !error; loop++) {
+      if(!root[loop])
+         continue;
+      if(readCheckedBlock(mount, root[loop], block) != 0) {
+         error = READ_ERROR;
+         break;
+      }
+      copy = allocExtent(snaproot + 1, 1, &got);
+      setBitmap(snapmap, root[loop], FREE);
+      setBitmap(snapmap, copy, USED);
+      error = writeCheckedBlock(mount, copy, block);
+      root[loop] = copy;
+   }
+   if(!error)
+      error = writeCheckedBlock(mount, snaproot, root);
+   if(!error) {
+      makesuperblock(snapmap, block);
+      block[2] = snaproot;
+      error = writeCheckedBlock(mount, snapsuper, block);
+   }
+   if(error) {
+      syncalloc();
+      return error;
+   }
+
+   // Publishing the table entry is what makes the snapshot exist
+   for(loop = 0; loop < BITMAP_SIZE; loop++)
+      held[loop] |= snapmap[loop];
+   memcpy(super + HELD_FIRST_ADDR, held, BITMAP_SIZE);
+   entry[0] = snapsuper;
+   memset(entry + 1, '\0', MAX_NAME_SIZE);
+   strncpy((char *)entry + 1, name, MAX_NAME_SIZE);
+   if((error = writeCheckedBlock(mount, SUPERBLOCK_ADDR, super)) != 0)
+      syncalloc();
+   return error;
+}
+
+int tfs_deleteSnapshot(char *name) {
+   uchar super[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   uchar snapmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE] = {0};
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   uchar *entry;
+   int slot;
+   int loop;
+   int blocknum;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(readCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0)
+      return READ_ERROR;
+   slot = findsnapshot(super, name);
+   if(slot == FILE_NOT_FOUND)
+      return FILE_NOT_FOUND;
+   if(snapshots[slot] != NULL_ADDR)
+      return OPEN_FAILURE;
+
+   entry = super + SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE;
+   if(readCheckedBlock(mount, entry[0], block) != 0)
+      return READ_ERROR;
+   memcpy(snapmap, block + BITMAP_FIRST_ADDR, BITMAP_SIZE);
+   memset(entry, NULL_ADDR, SNAPSHOT_ENTRY_SIZE);
+
+   // A block's reference count is the live bitmap plus every snapshot bitmap
+   // that has it, so rebuild the held map from the snapshots that remain
+   for(slot = 0; slot < MAX_NUM_SNAPSHOTS; slot++) {
+      entry = super + SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE;
+      if(entry[0] == NULL_ADDR)
+         continue;
+      if(readCheckedBlock(mount, entry[0], block) != 0)
+         return READ_ERROR;
+      for(loop = 0; loop < BITMAP_SIZE; loop++)
+         held[loop] |= block[BITMAP_FIRST_ADDR + loop];
+   }
+   memcpy(super + HELD_FIRST_ADDR, held, BITMAP_SIZE);
+   if(writeCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0)
+      return WRITE_ERROR;
+
+   for(blocknum = 0; blocknum < diskblocks(); blocknum++) {
+      if(blockinuse(snapmap, blocknum) && !blockinuse(held, blocknum) &&
+         !blockinuse(super + BITMAP_FIRST_ADDR, blocknum)) {
+         allocMark(blocknum, 1, FREE);
+         freed[blocknum] = TRUE;
+      }
+   }
+   discardruns(freed);
+   return 0;
+}
+
+int tfs_mountSnapshot(char *name) {
+   uchar super[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   int slot;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(readCheckedBlock(mount, SUPERBLOCK_ADDR, super) != 0)
+      return READ_ERROR;
+   slot = findsnapshot(super, name);
+   if(slot == FILE_NOT_FOUND)
+      return FILE_NOT_FOUND;
+   if(readCheckedBlock(mount, super[SNAPSHOT_FIRST_ADDR + slot * SNAPSHOT_ENTRY_SIZE],
+                      block) != 0)
+      return READ_ERROR;
+   if(block[0] != SUPERBLOCK)
+      return CORRUPT_FS;
+
+   snapshots[slot] = block[2];
+   return slot;
+}
+
+int tfs_unmountSnapshot(int snapshot) {
+   int i;
+
+   if(snapshot < 0 || snapshot >= MAX_NUM_SNAPSHOTS || snapshots[snapshot] == NULL_ADDR)
+      return FILE_NOT_FOUND;
+
+   for(i = 0; i < MAX_NUM_FILES; i++) {
+      if(table[i].valid == VALID && table[i].root == snapshots[snapshot])
+         releaseFD(i);
+   }
+   snapshots[snapshot] = NULL_ADDR;
+   return 0;
+}
+
+fileDescriptor tfs_openSnapshotFile(int snapshot, char *name) {
+   uchar block[BLOCKSIZE];
+   int inode;
+
+   if(snapshot < 0 || snapshot >= MAX_NUM_SNAPSHOTS || snapshots[snapshot] == NULL_ADDR)
+      return FILE_NOT_FOUND;
+
+   inode = findInodeBlock(name, mount, snapshots[snapshot]);
+   if(inode == FILE_NOT_FOUND)
+      return FILE_NOT_FOUND;
+   if(inode < 0 || readCheckedBlock(mount, inode, block) != 0)
+      return READ_ERROR;
+
+   return allocFD(name, physblock(block, 0), snapshots[snapshot], inode,
+                  getFileSize(block));
+}
+
+int tfs_fragmentation(void) {
+   uchar root[BLOCKSIZE];
+   uchar inode[BLOCKSIZE];
+   uchar chain[MAX_NUM_BLOCKS + 1];
+   int loop;
+   int count;
+   int i;
+   int links = 0;
+   int breaks = 0;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++) {
+      if(!root[loop])
+         continue;
+      if(readCheckedBlock(mount, root[loop], inode) != 0)
+         return READ_ERROR;
+      if((count = readchain(inode, chain)) < 0)
+         return count;
+      for(i = 1; i < count; i++) {
+         links++;
+         if(chain[i] != chain[i - 1] + 1)
+            breaks++;
+      }
+   }
+
+   return links ? breaks * 100 / links : 0;
+}
+
+/* Copies the chain of the file with inode inodeblock into one contiguous run.
+   Returns the number of blocks moved, 0 if the file is already contiguous or
+   there is no free run long enough */
+static int relocatefile(uchar inodeblock) {
+   uchar inode[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar chain[MAX_NUM_BLOCKS + 1];
+   uchar freed[MAX_NUM_BLOCKS] = {0};
+   char name[MAX_NAME_SIZE + 1] = {0};
+   int count;
+   int start;
+   int got;
+   int i;
+
+   if(readCheckedBlock(mount, inodeblock, inode) != 0)
+      return READ_ERROR;
+   if((count = readchain(inode, chain)) < 0)
+      return count;
+   for(i = 1; i < count && chain[i] == chain[i - 1] + 1; i++)
+      ;
+   if(count <= 1 || i == count)
+      return 0;
+
+   start = allocExtent(inodeblock + 1, count, &got);
+   if(start == ROOT_DIRECTORY_FULL)
+      return 0;
+   if(got < count) {
+      allocMark(start, got, FREE);
+      return 0;
+   }
+
+   // The new run is marked in use before anything points at it, and the old
+   // one freed only after, so a crash in between leaks one of the two
+   if(getBitmap(mount, bitmap) || getHeldBitmap(mount, held)) {
+      syncalloc();
+      return READ_ERROR;
+   }
+   for(i = 0; i < count; i++)
+      setBitmap(bitmap, start + i, USED);
+   if(updateBitmap(bitmap) != 0) {
+      syncalloc();
+      return WRITE_ERROR;
+   }
+
+   for(i = 0; i < count; i++) {
+      if(readCheckedBlock(mount, chain[i], block) != 0) {
+         syncalloc();
+         return READ_ERROR;
+      }
+      block[2] = i + 1 < count ? start + i + 1 : NULL_ADDR;
+      block[3] = i + 1 < count ? VALID : INVALID;
+      if(writeCheckedBlock(mount, start + i, block) != 0) {
+         syncalloc();
+         return WRITE_ERROR;
+      }
+   }
+
+   // The file switches to the new run once its inode points there
+   inode[2] = start;
+   if(writeCheckedBlock(mount, inodeblock, inode) != 0) {
+      syncalloc();
+      return WRITE_ERROR;
+   }
+
+   // An open descriptor keeps its position but moves to the new blocks
+   memcpy(name, inode + NAME_INDEX, MAX_NAME_SIZE);
+   i = findFD(name);
+   if(i >= 0) {
+      table[i].blocknum = start;
+      table[i].current_block = physblock(inode, table[i].pos / DATA_SIZE);
+      dropmap(i);
+   }
+
+   for(i = 0; i < count; i++) {
+      setBitmap(bitmap, chain[i], FREE);
+      if(!blockinuse(held, chain[i])) {
+         allocMark(chain[i], 1, FREE);
+         freed[chain[i]] = TRUE;
+      }
+   }
+   if(updateBitmap(bitmap) != 0) {
+      syncalloc();
+      return WRITE_ERROR;
+   }
+   discardruns(freed);
+
+   return count;
+}
+
+int tfs_defrag(int budget) {
+   uchar root[BLOCKSIZE];
+   uchar inode[BLOCKSIZE];
+   int moved = 0;
+   int result;
+
+   if(mount == INVALID)
+      return OPEN_FAILURE;
+   if(mountreadonly)
+      return READ_ONLY_FS;
+   if(readCheckedBlock(mount, ROOT_ADDR, root) != 0)
+      return READ_ERROR;
+
+   while(ROOT_FIRST_ADDR + defragnext < CHECKSUM_INDEX) {
+      if(root[ROOT_FIRST_ADDR + defragnext]) {
+         if(readCheckedBlock(mount, root[ROOT_FIRST_ADDR + defragnext], inode) != 0)
+            return READ_ERROR;
+         // Always move the first file, so every call makes progress
+         if(moved && moved + inode[BLOCKS_INDEX] > budget)
+            return moved;
+         result = relocatefile(root[ROOT_FIRST_ADDR + defragnext]);
+         if(result < 0)
+            return result;
+         moved += result;
+      }
+      defragnext++;
+   }
 
-   accessed = localtime(&rawaccessed);
-   str = asctime(accessed);
-   printf("   Accessed: %s\n", str);
+   defragnext = 0;
+   return moved;
 }
@@ -3,6 +3,8 @@
 
 #include "libDisk.h"
 #include "libTinyFS.h"
+#include "codec.h"
+#include <stddef.h>
 #include <time.h>
 #include <assert.h>
 
@@ -17,6 +19,7 @@ You must be able to support different possible values */
 #define INODE 0x02
 #define FILE_EXTENT 0x03
 #define FREE_BLOCK 0x04
+#define XATTR_BLOCK 0x05
 #define SUPERBLOCK_ADDR 0x00
 #define ROOT_ADDR 0x01
 #define NULL_ADDR 0x00
@@ -27,41 +30,132 @@ You must be able to support different possible values */
 #define VALID 0x50
 #define MAX_NUM_BLOCKS 256
 #define MAX_NUM_FREE_BLOCKS 254
-#define MAX_NUM_FILES 244
+#define MAX_NUM_FILES 240
 #define MAX_DISK_SIZE 65536
-#define DATA_SIZE 252
-#define BITMAP_SIZE 252
+#define DATA_SIZE 248
+#define BITMAP_SIZE 32
 #define MAX_NAME_SIZE 8
 #define DEFAULT_FIRST_BITMAP_BYTE 0xC0
 #define ROOT_FIRST_ADDR 12
 #define BITMAP_FIRST_ADDR 4
 #define BITS_PER_BYTE 8
-#define CREATION_INDEX 17
-#define MOD_INDEX 25
-#define ACCESS_INDEX 33
-
-#define SWAP_ENDIAN_INT(x) \
-((((x) & 0xFF000000) >> 24) |\
-(((x) & 0x00FF0000) >> 8) |\
-(((x) & 0x0000FF00) << 8) |\
-(((x) & 0x000000FF) << 24))
-
-#define SWAP_ENDIAN_LONG(x) \
-((((x) & 0xFF00000000000000) >> 56) |\
-(((x) & 0x00FF000000000000) >> 40) |\
-(((x) & 0x0000FF0000000000) >> 24) |\
-(((x) & 0x000000FF00000000) >> 8) |\
-(((x) & 0x00000000FF000000) << 8) |\
-(((x) & 0x0000000000FF0000) << 24) |\
-(((x) & 0x000000000000FF00) << 40) |\
-(((x) & 0x00000000000000FF) << 56))
-
+/* Superblock layout after the bitmap: a second bitmap of blocks still
+   referenced by a snapshot, then the snapshot table. Each table entry is
+   the address of the snapshot's superblock followed by its name */
+#define HELD_FIRST_ADDR 36
+#define SNAPSHOT_FIRST_ADDR 68
+#define SNAPSHOT_ENTRY_SIZE 9
+#define MAX_NUM_SNAPSHOTS 8
+/* Inodes record holes (runs of zero blocks with nothing on disk) in a table
+   after the timestamps. Each entry is a 2 byte first block and 2 byte count */
+#define HOLE_ENTRY_SIZE 4
+#define MAX_NUM_HOLES 8
+/* Superblock byte after the snapshot table that records whether the file
+system was unmounted cleanly. Mounting skips checkfs() when it is FS_CLEAN, and
+a read-write mount sets it to FS_DIRTY until it is unmounted */
+#define STATE_INDEX (SNAPSHOT_FIRST_ADDR + MAX_NUM_SNAPSHOTS * SNAPSHOT_ENTRY_SIZE)
+#define FS_CLEAN 0xC1
+#define FS_DIRTY 0x00
+/* Superblock counters after the state byte, 2 bytes each: blocks free for
+allocation and files in the root, saved by tfs_unmount and only trusted when
+the state is FS_CLEAN, then the quota of the root directory in blocks, 0 for
+none */
+#define FREE_COUNT_INDEX (STATE_INDEX + 1)
+#define FILE_COUNT_INDEX (STATE_INDEX + 3)
+#define ROOT_QUOTA_INDEX (STATE_INDEX + 5)
+/* Extended attributes are packed as name length, value length, name, value,
+ending at a zero name length or the end of the space. Smallest first, they
+fill the tail of the inode and spill into one XATTR_BLOCK */
+#define MAX_XATTR_NAME_SIZE 32
+#define MAX_XATTR_VALUE_SIZE 200
+/* Largest file, holes included, in blocks */
+#define MAX_FILE_BLOCKS 4096
+/* Last 4 bytes of every block hold a CRC32C of the bytes before them */
+#define CHECKSUM_INDEX 252
 
 typedef int fileDescriptor;
 typedef unsigned char uchar;
 typedef enum blockstate {FREE, USED} blockstate;
 typedef enum timestamp {CREATED, MODIFIED, ACCESSED} timestamp;
 
+/* On-disk layout of an inode block. Every field is a byte array, so there is
+   no padding and the multi-byte fields, stored big-endian, are read and
+   written with the helpers in codec.h. The root inode keeps its inode
+   pointers where a file keeps its block count */
+typedef struct dinode {
+   uchar type;
+   uchar magic;
+   uchar first;
+   uchar valid;
+   uchar name[MAX_NAME_SIZE];
+   uchar blocks;
+   uchar size[4];
+   uchar created[8];
+   uchar modified[8];
+   uchar accessed[8];
+   uchar holes[MAX_NUM_HOLES][HOLE_ENTRY_SIZE];
+   uchar quota[2];
+   uchar xattrblock;
+   uchar xattrs[CHECKSUM_INDEX - 76];
+} dinode;
+
+#define NAME_INDEX offsetof(dinode, name)
+#define BLOCKS_INDEX offsetof(dinode, blocks)
+#define SIZE_INDEX offsetof(dinode, size)
+#define CREATION_INDEX offsetof(dinode, created)
+#define MOD_INDEX offsetof(dinode, modified)
+#define ACCESS_INDEX offsetof(dinode, accessed)
+#define HOLE_INDEX offsetof(dinode, holes)
+#define FILE_QUOTA_INDEX offsetof(dinode, quota)
+#define XATTR_BLOCK_INDEX offsetof(dinode, xattrblock)
+#define XATTR_INDEX offsetof(dinode, xattrs)
+#define XATTR_TAIL_SIZE (CHECKSUM_INDEX - XATTR_INDEX)
+/* Room the attributes of a file take while they are repacked, with one more
+   entry being added past what the tail and the overflow block hold */
+#define XATTR_LIST_SIZE (XATTR_TAIL_SIZE + DATA_SIZE + BLOCKSIZE)
+
+_Static_assert(sizeof(dinode) == CHECKSUM_INDEX, "inode doesn't end at the checksum");
+_Static_assert(offsetof(dinode, blocks) == ROOT_FIRST_ADDR, "root pointers moved");
+_Static_assert(ROOT_QUOTA_INDEX + 2 <= CHECKSUM_INDEX, "superblock counters overlap the checksum");
+
+/* Fields of an inode decoded into native integers */
+typedef struct tinode {
+   uchar first;
+   uchar blocks;
+   int size;
+   time_t created;
+   time_t modified;
+   time_t accessed;
+   int holestart[MAX_NUM_HOLES];
+   int holecount[MAX_NUM_HOLES];
+   int quota;
+} tinode;
+
+/* A streaming write in progress on a descriptor, from tfs_writeBegin() to
+tfs_writeCommit(). Only the block being filled and the last one given space
+are kept in memory, every block before them is already on disk */
+typedef struct tstream {
+   /* Block each logical block so far went to, NULL_ADDR for holes */
+   uchar map[MAX_FILE_BLOCKS];
+   int nlogical;
+   int materialized;
+   int holes;
+   int size;
+   /* Logical block of the last block given space, -1 if there is none. It
+      is written once the block after it is known */
+   int pending;
+   char pendingdata[DATA_SIZE];
+   /* The block being filled and the bytes in it so far */
+   char data[DATA_SIZE];
+   int used;
+   /* Quota and data blocks of the file when the write began */
+   int quota;
+   int oldblocks;
+} tstream;
+
+/* Buckets of the table that maps names of open files to their descriptors */
+#define FD_BUCKETS 64
+
 /* Index of Files in Process File Table are the fileDescriptor numbers
       Ex: table[0] returns the tfile (metadata) of file number 0 */
 typedef struct tfile {
@@ -70,15 +164,77 @@ typedef struct tfile {
    uchar valid;
    char name[9];
    uchar current_block;
+   uchar root;
+   uchar readonly;
+   /* Inode and size of the file, kept here so I/O on the descriptor
+      doesn't have to look them up */
+   uchar inode;
+   int size;
+   /* Access time not yet written to the inode, 0 if there is none */
+   time_t accessed;
+   /* Block holding each logical block of the file, NULL_ADDR for holes.
+      Built the first time the descriptor leaves its first block and kept
+      up to date by writes; NULL until then */
+   uchar *map;
+   int mapsize;
+   /* Streaming write in progress, NULL if there is none */
+   tstream *stream;
+   /* Next free descriptor, or next open one in the same name bucket */
+   short next;
 } tfile;
 
+/* Metadata of a file, as filled in by tfs_stat, tfs_statMany and
+tfs_readDirEntries */
+typedef struct tstat {
+   char name[9];
+   int size;
+   /* Data blocks on disk, not counting holes or the inode */
+   int blocks;
+   /* Most data blocks the file may have, 0 for no limit */
+   int quota;
+   uchar inode;
+   time_t created;
+   time_t modified;
+   time_t accessed;
+} tstat;
+
+/* Usage of the mounted file system, as filled in by tfs_statfs */
+typedef struct tstatfs {
+   /* Blocks on the disk, and how many of them can still be allocated */
+   int blocks;
+   int free;
+   /* Files in the root, and how many more it has room for */
+   int files;
+   int freefiles;
+   /* Most blocks files and snapshots may use, 0 for no limit */
+   int quota;
+} tstatfs;
+
+/* Position of a directory listing. tfs_openDir copies the root's inode
+pointers in, so a listing reads the root once however many calls it takes */
+typedef struct tdir {
+   uchar inodes[MAX_NUM_FILES];
+   int next;
+} tdir;
+
 /* Makes a blank TinyFS file system of size nBytes on the file specified by filename.
 This function should use the emulated disk library to open the specified file, and upon
-success, format the file to be mountable. This includes initializing all data to 0x00,
-setting magic numbers, initializing and writing the superblock and inodes, etc. Must
+success, format the file to be mountable. Only the superblock and root inode are
+written: the disk sizes the image, so the rest reads as zeros, and free blocks are
+the ones clear in the bitmap. Takes the same time whatever nBytes is. Must
 return a specified success/error code. */
 int tfs_mkfs(char *filename, int nBytes);
 
+/* Makes a TinyFS file system of size nBytes on filename that holds count
+files, file i named names[i] with the sizes[i] bytes of buffers[i]. The image
+is laid out in memory, each inode followed by its data in one run, and written
+front to back in one pass. Zero blocks become holes as in tfs_writeFile.
+If nBytes is 0 the image is made just large enough.
+Returns ROOT_DIRECTORY_FULL if the files don't fit and WRITE_ERROR if two
+share a name */
+int tfs_pack(char *filename, int nBytes, char **names, char **buffers,
+             int *sizes, int count);
+
 /* tfs_mount(char *filename) mounts a TinyFS file system located within filename.
 tfs_unmount(void) unmounts the currently mounted file system. As part of the mount
 operation, tfs_mount should verify the file system is the correct type. Only one file
@@ -88,20 +244,71 @@ int tfs_mount(char *filename);
 
 int tfs_unmount(void);
 
+/* Mounts filename read-only through a shared memory mapping of the image
+(diskMmap.h), so processes mounting the same image share its pages. The names
+in the root are indexed once at mount, and lookups go through that index
+without touching the root again. Opening a missing file fails with
+FILE_NOT_FOUND, files are not stamped, and every call that would write fails
+with READ_ONLY_FS. Unmount with tfs_unmount() */
+int tfs_mountReadOnly(char *filename);
+
 /* Opens a file for reading and writing on the currently mounted file system.
 Creates a dynamic resource table entry for the file, and returns a file descriptor
-(integer) that can be used to reference this file while the filesystem is mounted. */
+(integer) that can be used to reference this file while the filesystem is mounted.
+The file is created if it doesn't exist; opening a file that is already open
+returns the descriptor it has. */
 fileDescriptor tfs_openFile(char *name);
 
-/* Closes the file, de-allocates all system/disk resources, and removes table entry */
+/* Closes the file, de-allocates all system/disk resources, and removes table entry.
+Reads only update a file's access time in memory; it is written to the inode here,
+or when the file system is unmounted. */
 int tfs_closeFile(fileDescriptor FD);
 
 /* Writes buffer buffer of size size, which represents an entire files content,
 to the file system. Sets the file pointer to 0 (the start of file) when done.
+Blocks that are all zeros are stored as holes and take no space on disk.
 Returns success/error codes. */
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
 
-/* deletes a file and marks its blocks as free on disk. */
+/* Replace the contents of a file without holding them in memory at once.
+tfs_writeBegin() starts a new version of the file, tfs_writeChunk() appends
+size bytes of buffer to it and tfs_writeCommit() makes it the file, with its
+size and inode going out together as tfs_writeFile() would. Every full block
+is written to new space as soon as the next one starts, so memory stays at two
+blocks whatever the size, and zero blocks become holes. Until the commit the
+file reads as it was, and tfs_writeAbort(), closing or deleting the file drop
+the new version. The old and new versions both take space until the commit.
+If the new version can't grow, tfs_writeChunk() drops it and returns
+ROOT_DIRECTORY_FULL, QUOTA_EXCEEDED or FILE_TOO_LARGE. The calls return
+OPEN_FAILURE if there is no streaming write on FD, or for tfs_writeBegin() if
+there already is one. */
+int tfs_writeBegin(fileDescriptor FD);
+int tfs_writeChunk(fileDescriptor FD, char *buffer, int size);
+int tfs_writeCommit(fileDescriptor FD);
+int tfs_writeAbort(fileDescriptor FD);
+
+/* Copies up to size bytes of the file starting at byte offset into buffer,
+without moving the file pointer. Holes read as zeros.
+Returns the number of bytes copied, which is 0 at or past the end of the file */
+int tfs_readAt(fileDescriptor FD, char *buffer, int size, int offset);
+
+/* Writes size bytes of buffer into the file starting at byte offset, growing
+the file if they run past its end, without moving the file pointer. Bytes that
+land in blocks the file already has are written in place.
+Returns size, or an error if nothing was written */
+int tfs_writeAt(fileDescriptor FD, char *buffer, int size, int offset);
+
+/* Sets the size of the file to len bytes. Shrinking drops the blocks past len
+with a single bitmap update; growing adds a hole, which takes no blocks. */
+int tfs_truncate(fileDescriptor FD, int len);
+
+/* Allocates zero-filled blocks for bytes offset to offset + len of the file,
+filling any holes in that range with one contiguous run where possible. Grows
+the file if the range ends past its end. */
+int tfs_fallocate(fileDescriptor FD, int offset, int len);
+
+/* deletes a file and marks its blocks as free in the bitmap. The blocks
+themselves are not written, only discarded. */
 int tfs_deleteFile(fileDescriptor FD);
 
 /* reads one byte from the file and copies it to buffer, using the current file pointer
@@ -114,8 +321,111 @@ int tfs_seek(fileDescriptor FD, int offset);
 
 int tfs_rename(fileDescriptor file, char *name);
 
+/* Prints the name of every file in the root directory */
 int tfs_readdir();
 
+/* Prints the name and timestamps of the file */
 void tfs_readFileInfo(fileDescriptor FD);
 
+/* Fills stat with the metadata of file name, decoded from a single read of
+its inode. Returns FILE_NOT_FOUND if there is no such file. */
+int tfs_stat(char *name, tstat *stat);
+
+/* Same as tfs_stat, for the file whose inode is in block inode. Fails with
+FILE_NOT_FOUND unless that block is the inode of a file in the root */
+int tfs_statInode(int inode, tstat *stat);
+
+/* Fills stat with the usage of the mounted file system without reading the
+disk. The counts are kept up to date in memory by every call that allocates,
+frees, creates or deletes, saved in the superblock at unmount and loaded at
+mount; after a crash they are counted again from the root and bitmaps. */
+int tfs_statfs(tstatfs *stat);
+
+/* Limits the blocks in use by files and snapshots, inodes included, to blocks
+(0 removes the limit). Calls that would take blocks past it fail with
+QUOTA_EXCEEDED; shrinking and deleting always work, so usage over a lowered
+quota can be brought back under it. Defragmentation is not limited. */
+int tfs_setQuota(int blocks);
+
+/* Same as tfs_setQuota for the data blocks of one file, kept in its inode */
+int tfs_setFileQuota(fileDescriptor FD, int blocks);
+
+/* Sets extended attribute name of the file to the size bytes of value,
+replacing any value it had. Names are up to MAX_XATTR_NAME_SIZE bytes and values
+up to MAX_XATTR_VALUE_SIZE. Attributes are kept in the inode, so they are read
+with it; those that don't fit spill to one overflow block.
+Returns FILE_TOO_LARGE if the file's attributes would not fit in both */
+int tfs_setxattr(fileDescriptor FD, char *name, char *value, int size);
+
+/* Copies the value of extended attribute name into value and returns its size.
+With size 0 only the size is returned. Returns FILE_NOT_FOUND if the file has
+no such attribute, and FILE_TOO_LARGE if the value is longer than size */
+int tfs_getxattr(fileDescriptor FD, char *name, char *value, int size);
+
+/* Copies the names of the file's extended attributes into list, each followed
+by a '\0', and returns the bytes they take. Size 0 and too small a size work
+as in tfs_getxattr */
+int tfs_listxattr(fileDescriptor FD, char *list, int size);
+
+/* Removes extended attribute name, FILE_NOT_FOUND if the file has none */
+int tfs_removexattr(fileDescriptor FD, char *name);
+
+/* Starts a listing of the root directory in dir. */
+int tfs_openDir(tdir *dir);
+
+/* Fills up to max entries of stats with the next files of the listing in dir
+and returns how many it filled; 0 means the listing is done. Each file's inode
+is read once. */
+int tfs_readDirEntries(tdir *dir, tstat *stats, int max);
+
+/* Opens count files at once, creating the ones that don't exist, and stores
+their file descriptors in fds. The whole batch costs one bitmap write, one root
+write and one write per new inode, instead of several of each per file. Either
+every file is opened or, if the root, the disk or the file table can't fit the
+batch, none are and ROOT_DIRECTORY_FULL is returned. */
+int tfs_createMany(char **names, int count, fileDescriptor *fds);
+
+/* Deletes the files open as fds[0] to fds[count - 1] with one bitmap and one
+root write for the whole batch. Nothing is deleted if any descriptor is
+invalid or read-only. */
+int tfs_deleteMany(fileDescriptor *fds, int count);
+
+/* Fills stats[i] with the metadata of file names[i], reading the root and
+each inode only once for the whole batch. Entries of names that don't exist
+are zeroed and FILE_NOT_FOUND is returned. */
+int tfs_statMany(char **names, int count, tstat *stats);
+
+/* Creates a read-only snapshot of the mounted file system called name.
+Only the bitmap, root and inodes are copied; file data is shared with the live
+file system until it is rewritten, at which point the live file gets new blocks.
+Returns ROOT_DIRECTORY_FULL if the snapshot table or the disk is full. */
+int tfs_snapshot(char *name);
+
+/* Deletes snapshot name and frees any blocks only it was holding. Fails if the
+snapshot is currently mounted. */
+int tfs_deleteSnapshot(char *name);
+
+/* Mounts snapshot name read-only alongside the live file system and returns a
+handle to open its files with. */
+int tfs_mountSnapshot(char *name);
+
+int tfs_unmountSnapshot(int snapshot);
+
+/* Opens file name inside a mounted snapshot. The file descriptor works with
+tfs_readByte, tfs_seek and tfs_readFileInfo; anything that would modify the
+file returns READ_ONLY_FS. */
+fileDescriptor tfs_openSnapshotFile(int snapshot, char *name);
+
+/* Returns how fragmented the mounted file system is, from 0 (every file is one
+contiguous run of blocks) to 100 (no two consecutive blocks of a file are
+adjacent on disk). */
+int tfs_fragmentation(void);
+
+/* Moves fragmented files into contiguous runs of blocks, rewriting their chains
+and inode pointers. Each call moves at most budget blocks (though always at least
+one file) and resumes where the previous call stopped, so it can be interleaved
+with other work on a mounted file system. Returns the number of blocks moved;
+0 means the rest of the pass found nothing to move and the next call starts over. */
+int tfs_defrag(int budget);
+
 #endif
@@ -10,6 +10,10 @@
 #define ROOT_DIRECTORY_FULL -7
 #define DISK_CLOSE_FAILURE -8
 #define SEEK_ERROR -9
+#define READ_ONLY_FS -10
+#define FILE_TOO_LARGE -11
+#define QUOTA_EXCEEDED -12
+#define QUEUE_FULL -13
 
 
 
@@ -0,0 +1,176 @@
+#include "alloc.h"
+#include "TinyFS_errno.h"
+
+/* The free extent tree is a segment tree over every addressable block. Each
+   node covers an aligned range of blocks and stores the length of the free
+   run at its start, the free run at its end and the longest free run inside
+   it, so runs can be found both by position and by length in O(log n).
+   Leaves are nodes MAX_NUM_BLOCKS to 2 * MAX_NUM_BLOCKS - 1 */
+#define TREE_SIZE (2 * MAX_NUM_BLOCKS)
+
+static short prefix[TREE_SIZE];
+static short suffix[TREE_SIZE];
+static short best[TREE_SIZE];
+static short groupfree[MAX_NUM_GROUPS];
+static int numgroups = 0;
+static int rotor = 0;
+
+/* Number of blocks covered by node */
+static int span(int node) {
+   int size = MAX_NUM_BLOCKS;
+
+   while(node > 1) {
+      node >>= 1;
+      size >>= 1;
+   }
+   return size;
+}
+
+/* First block covered by node */
+static int nodestart(int node) {
+   return node * span(node) - MAX_NUM_BLOCKS;
+}
+
+static void pull(int node) {
+   int left = 2 * node;
+   int right = left + 1;
+   int half = span(left);
+
+   prefix[node] = prefix[left] == half ? half + prefix[right] : prefix[left];
+   suffix[node] = suffix[right] == half ? half + suffix[left] : suffix[right];
+   best[node] = best[left] > best[right] ? best[left] : best[right];
+   if(suffix[left] + prefix[right] > best[node])
+      best[node] = suffix[left] + prefix[right];
+}
+
+static void setleaf(int blocknum, int free) {
+   int node = MAX_NUM_BLOCKS + blocknum;
+
+   if(free && !best[node])
+      groupfree[blocknum / ALLOC_GROUP_SIZE]++;
+   else if(!free && best[node])
+      groupfree[blocknum / ALLOC_GROUP_SIZE]--;
+
+   prefix[node] = suffix[node] = best[node] = free ? 1 : 0;
+   for(node >>= 1; node > 0; node >>= 1)
+      pull(node);
+}
+
+/* Returns the first block of the leftmost run of want free blocks inside
+    node, or -1 if there is none */
+static int findfit(int node, int want) {
+   int left;
+
+   if(want <= 0 || best[node] < want)
+      return -1;
+   while(node < MAX_NUM_BLOCKS) {
+      left = 2 * node;
+      if(best[left] >= want)
+         node = left;
+      else if(suffix[left] + prefix[left + 1] >= want)
+         return nodestart(left + 1) - suffix[left];
+      else
+         node = left + 1;
+   }
+   return node - MAX_NUM_BLOCKS;
+}
+
+static int groupnode(int group) {
+   return MAX_NUM_BLOCKS / ALLOC_GROUP_SIZE + group;
+}
+
+void allocInit(uchar *used, int numblocks) {
+   int blocknum;
+   int node;
+   int free;
+
+   memset(groupfree, 0, sizeof(groupfree));
+   for(blocknum = 0; blocknum < MAX_NUM_BLOCKS; blocknum++) {
+      node = MAX_NUM_BLOCKS + blocknum;
+      free = blocknum < numblocks &&
+             !GETBIT(used[blocknum / BITS_PER_BYTE], 7 - blocknum % BITS_PER_BYTE);
+      prefix[node] = suffix[node] = best[node] = free;
+      groupfree[blocknum / ALLOC_GROUP_SIZE] += free;
+   }
+   for(node = MAX_NUM_BLOCKS - 1; node > 0; node--)
+      pull(node);
+
+   numgroups = (numblocks - 1) / ALLOC_GROUP_SIZE + 1;
+   if(numgroups > MAX_NUM_GROUPS)
+      numgroups = MAX_NUM_GROUPS;
+   rotor = 0;
+}
+
+int allocInode(void) {
+   int group = -1;
+   int loop;
+   int candidate;
+   int blocknum;
+
+   // Spread new files over the groups, emptiest group first
+   for(loop = 0; loop < numgroups; loop++) {
+      candidate = (rotor + loop) % numgroups;
+      if(group < 0 || groupfree[candidate] > groupfree[group])
+         group = candidate;
+   }
+   if(group < 0 || !groupfree[group])
+      return ROOT_DIRECTORY_FULL;
+   rotor = (group + 1) % numgroups;
+
+   // Leave room for the first data block right after the inode
+   blocknum = findfit(groupnode(group), 2);
+   if(blocknum < 0)
+      blocknum = findfit(groupnode(group), 1);
+   setleaf(blocknum, FALSE);
+   return blocknum;
+}
+
+int allocExtent(int hint, int want, int *got) {
+   int start = -1;
+   int run = 0;
+   int group;
+   int loop;
+
+   if(want > MAX_NUM_BLOCKS)
+      want = MAX_NUM_BLOCKS;
+   if(hint < 0 || hint >= MAX_NUM_BLOCKS)
+      hint = 0;
+
+   // Continue right where the caller left off if the blocks are free
+   while(run < want && hint + run < MAX_NUM_BLOCKS &&
+         best[MAX_NUM_BLOCKS + hint + run])
+      run++;
+   if(run && run == want)
+      start = hint;
+
+   group = hint / ALLOC_GROUP_SIZE;
+   for(loop = 0; start < 0 && loop < numgroups; loop++)
+      start = findfit(groupnode((group + loop) % numgroups), want);
+   // A run may also straddle two groups
+   if(start < 0)
+      start = findfit(1, want);
+   if(start < 0) {
+      want = best[1];
+      start = findfit(1, want);
+   }
+   if(start < 0)
+      return ROOT_DIRECTORY_FULL;
+
+   allocMark(start, want, USED);
+   *got = want;
+   return start;
+}
+
+void allocMark(int start, int count, blockstate state) {
+   while(count-- > 0 && start < MAX_NUM_BLOCKS)
+      setleaf(start++, state == FREE);
+}
+
+int allocFreeCount(void) {
+   int total = 0;
+   int group;
+
+   for(group = 0; group < MAX_NUM_GROUPS; group++)
+      total += groupfree[group];
+   return total;
+}
@@ -0,0 +1,35 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "TinyFS.h"
+
+/* Blocks per allocation group. Each group is one subtree of the free extent
+   tree, so new files are spread across groups and a file's blocks are kept
+   near its inode */
+#define ALLOC_GROUP_SIZE 64
+#define MAX_NUM_GROUPS (MAX_NUM_BLOCKS / ALLOC_GROUP_SIZE)
+
+/* Builds the free extent tree of the mounted disk. used must have a bit set
+    for every block that can't be handed out (live or held by a snapshot);
+    blocks at or past numblocks are never handed out */
+void allocInit(uchar *used, int numblocks);
+
+/* Returns a block for a new inode, taken from the group with the most free
+    blocks
+   Returns ROOT_DIRECTORY_FULL if the disk is full */
+int allocInode(void);
+
+/* Allocates up to want contiguous blocks and returns the first one, storing
+    the number allocated in got. Prefers a run starting at hint, then the
+    first run of want blocks in hint's group, then in any group. If no run is
+    long enough, the longest run is returned instead
+   Returns ROOT_DIRECTORY_FULL if the disk is full */
+int allocExtent(int hint, int want, int *got);
+
+/* Marks count blocks starting at start as USED or FREE */
+void allocMark(int start, int count, blockstate state);
+
+/* Returns the number of blocks that can still be allocated */
+int allocFreeCount(void);
+
+#endif
@@ -0,0 +1,251 @@
+#include "async.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef enum asyncop {
+   ASYNC_OPEN,
+   ASYNC_CLOSE,
+   ASYNC_READ,
+   ASYNC_WRITE,
+   ASYNC_WRITE_FILE
+} asyncop;
+
+/* One queued call. Requests go from the spare list to the pending queue,
+   and once run to the finished queue until their callback is called */
+typedef struct request {
+   asyncop op;
+   fileDescriptor FD;
+   char name[MAX_NAME_SIZE + 1];
+   char *buffer;
+   int size;
+   int offset;
+   int result;
+   asyncCallback done;
+   void *arg;
+   struct request *next;
+} request;
+
+typedef struct queue {
+   request *head;
+   request *tail;
+} queue;
+
+static request requests[ASYNC_QUEUE_SIZE];
+static request *spare = NULL;
+static queue pending;
+static queue finished;
+/* Requests queued whose results haven't reached the finished queue yet */
+static int inflight = 0;
+static int running = FALSE;
+static int stopping = FALSE;
+static int notify[2] = {-1, -1};
+static pthread_t worker;
+/* Guards the lists and counts above, never held while a request runs */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t landed = PTHREAD_COND_INITIALIZER;
+
+static void append(queue *list, request *first, request *last) {
+   last->next = NULL;
+   if(list->tail)
+      list->tail->next = first;
+   else
+      list->head = first;
+   list->tail = last;
+}
+
+static int run(request *req) {
+   switch(req->op) {
+   case ASYNC_OPEN:
+      return tfs_openFile(req->name);
+   case ASYNC_CLOSE:
+      return tfs_closeFile(req->FD);
+   case ASYNC_READ:
+      return tfs_readAt(req->FD, req->buffer, req->size, req->offset);
+   case ASYNC_WRITE:
+      return tfs_writeAt(req->FD, req->buffer, req->size, req->offset);
+   case ASYNC_WRITE_FILE:
+      return tfs_writeFile(req->FD, req->buffer, req->size);
+   }
+   return OPEN_FAILURE;
+}
+
+/* Takes the whole pending queue at a time, so callers queueing more only
+   wait for the lock, never for a request to run */
+static void *work(void *unused) {
+   request *batch;
+   request *last = NULL;
+   request *req;
+   char byte = 0;
+
+   (void)unused;
+   pthread_mutex_lock(&lock);
+   while(TRUE) {
+      while(!pending.head && !stopping)
+         pthread_cond_wait(&queued, &lock);
+      if(!pending.head)
+         break;
+      batch = pending.head;
+      pending.head = pending.tail = NULL;
+      pthread_mutex_unlock(&lock);
+
+      for(req = batch; req; req = req->next) {
+         req->result = run(req);
+         last = req;
+      }
+
+      pthread_mutex_lock(&lock);
+      for(req = batch; req; req = req->next)
+         inflight--;
+      append(&finished, batch, last);
+      pthread_cond_broadcast(&landed);
+      // A full pipe already says there is something to complete
+      if(write(notify[1], &byte, 1) < 0)
+         byte = 0;
+   }
+   pthread_mutex_unlock(&lock);
+   return NULL;
+}
+
+/* Fills in a spare request and queues it for the worker */
+static int submit(asyncop op, fileDescriptor FD, char *name, char *buffer,
+                  int size, int offset, asyncCallback done, void *arg) {
+   request *req;
+
+   pthread_mutex_lock(&lock);
+   if(!running || stopping) {
+      pthread_mutex_unlock(&lock);
+      return OPEN_FAILURE;
+   }
+   if(!spare) {
+      pthread_mutex_unlock(&lock);
+      return QUEUE_FULL;
+   }
+   req = spare;
+   spare = req->next;
+
+   req->op = op;
+   req->FD = FD;
+   memset(req->name, 0, sizeof(req->name));
+   if(name)
+      strncpy(req->name, name, MAX_NAME_SIZE);
+   req->buffer = buffer;
+   req->size = size;
+   req->offset = offset;
+   req->done = done;
+   req->arg = arg;
+   append(&pending, req, req);
+   inflight++;
+   pthread_cond_signal(&queued);
+   pthread_mutex_unlock(&lock);
+   return 0;
+}
+
+int tfs_asyncStart(void) {
+   int i;
+
+   if(running)
+      return OPEN_FAILURE;
+   if(pipe(notify) != 0)
+      return OPEN_FAILURE;
+   fcntl(notify[0], F_SETFL, O_NONBLOCK);
+   fcntl(notify[1], F_SETFL, O_NONBLOCK);
+
+   spare = NULL;
+   for(i = ASYNC_QUEUE_SIZE - 1; i >= 0; i--) {
+      requests[i].next = spare;
+      spare = &requests[i];
+   }
+   pending.head = pending.tail = NULL;
+   finished.head = finished.tail = NULL;
+   inflight = 0;
+   stopping = FALSE;
+   if(pthread_create(&worker, NULL, work, NULL) != 0) {
+      close(notify[0]);
+      close(notify[1]);
+      return OPEN_FAILURE;
+   }
+   running = TRUE;
+   return 0;
+}
+
+int tfs_asyncStop(void) {
+   if(!running)
+      return OPEN_FAILURE;
+   pthread_mutex_lock(&lock);
+   stopping = TRUE;
+   pthread_cond_signal(&queued);
+   pthread_mutex_unlock(&lock);
+   pthread_join(worker, NULL);
+
+   tfs_asyncComplete(FALSE);
+   close(notify[0]);
+   close(notify[1]);
+   notify[0] = notify[1] = -1;
+   running = FALSE;
+   return 0;
+}
+
+int tfs_asyncFd(void) {
+   return running ? notify[0] : OPEN_FAILURE;
+}
+
+int tfs_asyncComplete(int wait) {
+   request *req;
+   request *next;
+   asyncCallback done;
+   void *arg;
+   char drain[64];
+   int result;
+   int count = 0;
+
+   pthread_mutex_lock(&lock);
+   while(wait && !finished.head && inflight)
+      pthread_cond_wait(&landed, &lock);
+   req = finished.head;
+   finished.head = finished.tail = NULL;
+   while(read(notify[0], drain, sizeof(drain)) > 0)
+      ;
+   pthread_mutex_unlock(&lock);
+
+   // Each request is spare again before its callback, which may reuse it
+   for(; req; req = next, count++) {
+      next = req->next;
+      done = req->done;
+      arg = req->arg;
+      result = req->result;
+      pthread_mutex_lock(&lock);
+      req->next = spare;
+      spare = req;
+      pthread_mutex_unlock(&lock);
+      if(done)
+         done(arg, result);
+   }
+   return count;
+}
+
+int tfs_asyncOpen(char *name, asyncCallback done, void *arg) {
+   if(!name)
+      return FILE_NOT_FOUND;
+   return submit(ASYNC_OPEN, -1, name, NULL, 0, 0, done, arg);
+}
+
+int tfs_asyncClose(fileDescriptor FD, asyncCallback done, void *arg) {
+   return submit(ASYNC_CLOSE, FD, NULL, NULL, 0, 0, done, arg);
+}
+
+int tfs_asyncRead(fileDescriptor FD, char *buffer, int size, int offset,
+                  asyncCallback done, void *arg) {
+   return submit(ASYNC_READ, FD, NULL, buffer, size, offset, done, arg);
+}
+
+int tfs_asyncWrite(fileDescriptor FD, char *buffer, int size, int offset,
+                   asyncCallback done, void *arg) {
+   return submit(ASYNC_WRITE, FD, NULL, buffer, size, offset, done, arg);
+}
+
+int tfs_asyncWriteFile(fileDescriptor FD, char *buffer, int size,
+                       asyncCallback done, void *arg) {
+   return submit(ASYNC_WRITE_FILE, FD, NULL, buffer, size, 0, done, arg);
+}
@@ -0,0 +1,49 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "TinyFS.h"
+
+/* Requests that can be in flight at once */
+#define ASYNC_QUEUE_SIZE 4096
+
+/* Called once a request has run, with the arg it was queued with and what
+   the tfs_ call returned */
+typedef void (*asyncCallback)(void *arg, int result);
+
+/* Starts the worker thread that runs queued requests one after another
+   against the mounted file system. Mount before queueing anything. The
+   synchronous tfs_ calls must not be made while requests are in flight,
+   since the library has a single mount and no locking of its own. Returns
+   OPEN_FAILURE if the worker is already running or can't be started */
+int tfs_asyncStart(void);
+
+/* Waits for every queued request to run, calls their callbacks and stops
+   the worker */
+int tfs_asyncStop(void);
+
+/* Returns a descriptor that polls readable while finished requests wait for
+   tfs_asyncComplete(), so an event loop can watch it with poll() or epoll
+   next to its sockets. OPEN_FAILURE if the worker isn't running */
+int tfs_asyncFd(void);
+
+/* Calls the callbacks of the requests that have finished, on the calling
+   thread, and returns how many ran. With wait, blocks until at least one
+   has finished unless nothing is in flight. Callbacks may queue more
+   requests */
+int tfs_asyncComplete(int wait);
+
+/* Queue the tfs_ call of the same name: tfs_openFile(), tfs_closeFile(),
+   tfs_readAt(), tfs_writeAt() and tfs_writeFile(). They return 0 once the
+   request is queued, without waiting for any I/O, OPEN_FAILURE if the worker
+   isn't running, or QUEUE_FULL with ASYNC_QUEUE_SIZE requests in flight.
+   Buffers must stay valid until the callback runs. done may be NULL */
+int tfs_asyncOpen(char *name, asyncCallback done, void *arg);
+int tfs_asyncClose(fileDescriptor FD, asyncCallback done, void *arg);
+int tfs_asyncRead(fileDescriptor FD, char *buffer, int size, int offset,
+                  asyncCallback done, void *arg);
+int tfs_asyncWrite(fileDescriptor FD, char *buffer, int size, int offset,
+                   asyncCallback done, void *arg);
+int tfs_asyncWriteFile(fileDescriptor FD, char *buffer, int size,
+                       asyncCallback done, void *arg);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Loads and stores of the big-endian integers in TinyFS blocks. They work at
+    any alignment, and the byte order is settled at compile time: on big-endian
+    hosts the swaps compile away, elsewhere they become a single bswap */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DISK16(x) (x)
+#define DISK32(x) (x)
+#define DISK64(x) (x)
+#else
+#define DISK16(x) __builtin_bswap16(x)
+#define DISK32(x) __builtin_bswap32(x)
+#define DISK64(x) __builtin_bswap64(x)
+#endif
+
+static inline uint16_t load16(const void *at) {
+   uint16_t value;
+
+   memcpy(&value, at, sizeof(value));
+   return DISK16(value);
+}
+
+static inline uint32_t load32(const void *at) {
+   uint32_t value;
+
+   memcpy(&value, at, sizeof(value));
+   return DISK32(value);
+}
+
+static inline uint64_t load64(const void *at) {
+   uint64_t value;
+
+   memcpy(&value, at, sizeof(value));
+   return DISK64(value);
+}
+
+static inline void store16(void *at, uint16_t value) {
+   value = DISK16(value);
+   memcpy(at, &value, sizeof(value));
+}
+
+static inline void store32(void *at, uint32_t value) {
+   value = DISK32(value);
+   memcpy(at, &value, sizeof(value));
+}
+
+static inline void store64(void *at, uint64_t value) {
+   value = DISK64(value);
+   memcpy(at, &value, sizeof(value));
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW 1
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t table[8][256];
+static int tableready = 0;
+#ifdef HAVE_CRC32C_HW
+static int usehw = -1;
+#endif
+
+static void inittable() {
+   uint32_t crc;
+   int i, j;
+
+   for(i = 0; i < 256; i++) {
+      crc = i;
+      for(j = 0; j < 8; j++)
+         crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+      table[0][i] = crc;
+   }
+   for(i = 0; i < 256; i++) {
+      crc = table[0][i];
+      for(j = 1; j < 8; j++) {
+         crc = (crc >> 8) ^ table[0][crc & 0xFF];
+         table[j][i] = crc;
+      }
+   }
+   tableready = 1;
+}
+
+/* Slicing-by-8: folds eight bytes per step through eight lookup tables */
+static uint32_t crc32csw(uint32_t crc, const unsigned char *buf, size_t len) {
+   uint32_t lo, hi;
+
+   if(!tableready)
+      inittable();
+
+   while(len && ((uintptr_t)buf & 7)) {
+      crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xFF];
+      len--;
+   }
+   while(len >= 8) {
+      memcpy(&lo, buf, 4);
+      memcpy(&hi, buf + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      lo = __builtin_bswap32(lo);
+      hi = __builtin_bswap32(hi);
+#endif
+      lo ^= crc;
+      crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+            table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+            table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+      buf += 8;
+      len -= 8;
+   }
+   while(len--)
+      crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xFF];
+
+   return crc;
+}
+
+#ifdef HAVE_CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32chw(uint32_t crc, const unsigned char *buf, size_t len) {
+   uint64_t crc64 = crc;
+   uint64_t word;
+
+   while(len && ((uintptr_t)buf & 7)) {
+      crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+      len--;
+   }
+   while(len >= 8) {
+      memcpy(&word, buf, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+      buf += 8;
+      len -= 8;
+   }
+   while(len--)
+      crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+
+   return (uint32_t)crc64;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+   crc = ~crc;
+#ifdef HAVE_CRC32C_HW
+   if(usehw < 0)
+      usehw = __builtin_cpu_supports("sse4.2");
+   if(usehw)
+      return ~crc32chw(crc, data, len);
+#endif
+   return ~crc32csw(crc, data, len);
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returns the CRC32C (Castagnoli) checksum of len bytes of data. Pass 0 as crc
+    to start a new checksum, or a previous result to continue one.
+   Uses the SSE4.2 crc32 instruction when the CPU has it, and a slicing-by-8
+    table lookup otherwise. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
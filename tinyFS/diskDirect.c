@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "diskDirect.h"
+#include "TinyFS.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* One buffer of the pool, holding physical block phys of the image. dirty
+   is the number of the write that first made it differ from the image, 0
+   while it doesn't */
+typedef struct pooled {
+   char *data;
+   int phys;
+   unsigned long dirty;
+   unsigned long used;
+} pooled;
+
+typedef struct direct {
+   /* The O_DIRECT descriptor, and a normal one for the last physical block
+      when the image doesn't end on a physical block boundary */
+   int fd;
+   int tailfd;
+   int physsize;
+   /* Physical blocks lying wholly inside the image */
+   int fullblocks;
+   unsigned long clock;
+   /* Number of the last write that dirtied a clean buffer */
+   unsigned long writes;
+   char *memory;
+   pooled pool[DIRECT_POOL_SIZE];
+   /* Next pool in the list of spares */
+   struct direct *spare;
+} direct;
+
+static int physsize = DEFAULT_PHYS_BLOCK_SIZE;
+/* Pools of closed disks, kept to be reused by the next disks opened */
+static direct *spares = NULL;
+
+/* Returns a pool of physsize buffers, a spare one if there is one */
+static direct *getpool() {
+   direct **link;
+   direct *dev;
+   int i;
+
+   for (link = &spares; *link; link = &(*link)->spare) {
+      if ((*link)->physsize == physsize) {
+         dev = *link;
+         *link = dev->spare;
+         dev->spare = NULL;
+         dev->clock = 0;
+         dev->writes = 0;
+         for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+            dev->pool[i].phys = -1;
+            dev->pool[i].dirty = 0;
+            dev->pool[i].used = 0;
+         }
+         return dev;
+      }
+   }
+
+   if ((dev = calloc(1, sizeof(direct))) == NULL)
+      return NULL;
+   if (posix_memalign((void **)&dev->memory, physsize,
+                      (size_t)physsize * DIRECT_POOL_SIZE) != 0) {
+      free(dev);
+      return NULL;
+   }
+   dev->physsize = physsize;
+   for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+      dev->pool[i].data = dev->memory + (size_t)i * physsize;
+      dev->pool[i].phys = -1;
+   }
+   return dev;
+}
+
+static void putpool(direct *dev) {
+   dev->spare = spares;
+   spares = dev;
+}
+
+int setPhysBlockSize(int bytes) {
+   if (bytes < BLOCKSIZE || bytes > MAX_DISK_SIZE || (bytes & (bytes - 1)))
+      return OPEN_FAILURE;
+   physsize = bytes;
+   return 0;
+}
+
+/* Moves buffer to or from the image. Transfers on the O_DIRECT descriptor
+   that the kernel rejects as misaligned are retried, and every later one
+   made, through the normal descriptor */
+static int transfer(Disk *disk, pooled *buffer, int write) {
+   direct *dev = disk->state;
+   off_t offset = (off_t)buffer->phys * dev->physsize;
+   size_t len = dev->physsize;
+   size_t done = 0;
+   ssize_t moved;
+   int fd = dev->fd;
+
+   if (buffer->phys >= dev->fullblocks) {
+      fd = dev->tailfd;
+      len = disk->size - offset;
+   }
+   while (done < len) {
+      if (write)
+         moved = pwrite(fd, buffer->data + done, len - done, offset + done);
+      else
+         moved = pread(fd, buffer->data + done, len - done, offset + done);
+      if (moved < 0 && errno == EINVAL && fd != dev->tailfd) {
+         close(dev->fd);
+         dev->fd = fd = dev->tailfd;
+         continue;
+      }
+      if (moved <= 0)
+         return write ? WRITE_ERROR : READ_ERROR;
+      done += moved;
+   }
+   return 0;
+}
+
+/* Writes back every buffer first dirtied by write upto or an earlier one,
+   oldest first, so the image takes the writes in the order they were made */
+static int flushupto(Disk *disk, unsigned long upto) {
+   direct *dev = disk->state;
+   pooled *oldest;
+   int i;
+
+   while (TRUE) {
+      oldest = NULL;
+      for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+         if (dev->pool[i].dirty && dev->pool[i].dirty <= upto &&
+             (!oldest || dev->pool[i].dirty < oldest->dirty))
+            oldest = &dev->pool[i];
+      }
+      if (!oldest)
+         return 0;
+      if (transfer(disk, oldest, TRUE) != 0)
+         return WRITE_ERROR;
+      oldest->dirty = 0;
+   }
+}
+
+/* Returns the pool buffer holding the physical block with block bNum in it,
+   loading it into the least recently used buffer if need be */
+static pooled *getbuffer(Disk *disk, int bNum) {
+   direct *dev = disk->state;
+   int phys = bNum * BLOCKSIZE / dev->physsize;
+   pooled *victim = &dev->pool[0];
+   int i;
+
+   for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+      if (dev->pool[i].phys == phys) {
+         dev->pool[i].used = ++dev->clock;
+         return &dev->pool[i];
+      }
+      if (dev->pool[i].used < victim->used)
+         victim = &dev->pool[i];
+   }
+
+   if (victim->dirty && flushupto(disk, victim->dirty) != 0)
+      return NULL;
+   victim->phys = phys;
+   if (transfer(disk, victim, FALSE) != 0) {
+      victim->phys = -1;
+      victim->used = 0;
+      return NULL;
+   }
+   victim->used = ++dev->clock;
+   return victim;
+}
+
+static int directopen(Disk *disk, char *filename, int nBytes) {
+   direct *dev = getpool();
+   int flags = O_RDWR;
+   struct stat info;
+
+   if (!dev)
+      return OPEN_FAILURE;
+   if (nBytes > 0)
+      flags |= O_CREAT | O_TRUNC;
+   dev->fd = open(filename, flags | O_DIRECT, 0644);
+   if (dev->fd < 0 && errno == EINVAL)
+      dev->fd = open(filename, flags, 0644);
+   dev->tailfd = open(filename, O_RDWR);
+   if (dev->fd < 0 || dev->tailfd < 0) {
+      if (dev->fd >= 0)
+         close(dev->fd);
+      if (dev->tailfd >= 0)
+         close(dev->tailfd);
+      putpool(dev);
+      return OPEN_FAILURE;
+   }
+
+   // New images are sized up front, in whole TinyFS blocks, so every
+   // physical block can be read before it is first written
+   nBytes = (nBytes + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+   if (nBytes > 0 && ftruncate(dev->fd, nBytes) == 0)
+      disk->size = nBytes;
+   else if (fstat(dev->fd, &info) == 0)
+      disk->size = info.st_size;
+   dev->fullblocks = disk->size / physsize;
+   disk->state = dev;
+   return 0;
+}
+
+static int directread(Disk *disk, int bNum, void *block) {
+   direct *dev = disk->state;
+   pooled *buffer;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return READ_ERROR;
+   if ((buffer = getbuffer(disk, bNum)) == NULL)
+      return READ_ERROR;
+   memcpy(block, buffer->data + bNum * BLOCKSIZE % dev->physsize, BLOCKSIZE);
+   return 0;
+}
+
+static int directwrite(Disk *disk, int bNum, void *block) {
+   direct *dev = disk->state;
+   pooled *buffer;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return WRITE_ERROR;
+   if ((buffer = getbuffer(disk, bNum)) == NULL)
+      return WRITE_ERROR;
+   // A dirty buffer only takes the write too if no other buffer was dirtied
+   // since. Otherwise every buffer goes out first, as the ones dirtied after
+   // it hold writes made before this one
+   if (buffer->dirty && buffer->dirty != dev->writes &&
+       flushupto(disk, dev->writes) != 0)
+      return WRITE_ERROR;
+   memcpy(buffer->data + bNum * BLOCKSIZE % dev->physsize, block, BLOCKSIZE);
+   if (!buffer->dirty)
+      buffer->dirty = ++dev->writes;
+   return 0;
+}
+
+static int directclose(Disk *disk) {
+   direct *dev = disk->state;
+   int error = 0;
+
+   if (flushupto(disk, dev->writes) != 0)
+      error = DISK_CLOSE_FAILURE;
+   if (dev->fd != dev->tailfd)
+      close(dev->fd);
+   close(dev->tailfd);
+   putpool(dev);
+   disk->state = NULL;
+   return error;
+}
+
+/* Forgets pooled buffers lying wholly inside the range, so they are never
+   written back, and punches out the physical blocks the range covers. Partly
+   covered physical blocks are left alone. The hole is punched after the
+   writes still pooled, which include the ones that freed the range */
+static int directdiscard(Disk *disk, int bNum, int count) {
+   direct *dev = disk->state;
+   int first = (bNum * BLOCKSIZE + dev->physsize - 1) / dev->physsize;
+   int last = (bNum + count) * BLOCKSIZE / dev->physsize;
+   int i;
+
+   if (last > dev->fullblocks)
+      last = dev->fullblocks;
+   if (first >= last)
+      return 0;
+   for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+      if (dev->pool[i].phys >= first && dev->pool[i].phys < last) {
+         dev->pool[i].phys = -1;
+         dev->pool[i].dirty = 0;
+         dev->pool[i].used = 0;
+      }
+   }
+   if (flushupto(disk, dev->writes) != 0)
+      return WRITE_ERROR;
+   return punchHole(dev->tailfd, first * dev->physsize / BLOCKSIZE,
+                    (last - first) * dev->physsize / BLOCKSIZE);
+}
+
+const diskops directDiskOps = {directopen, directread, directwrite, directclose,
+                               directdiscard};
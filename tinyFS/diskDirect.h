@@ -0,0 +1,28 @@
+#ifndef DISKDIRECT_H
+#define DISKDIRECT_H
+
+#include "libDisk.h"
+
+/* Default size of one aligned transfer, 16 TinyFS blocks */
+#define DEFAULT_PHYS_BLOCK_SIZE 4096
+/* Physical blocks cached per disk. This cache is the only one: the image is
+    opened with O_DIRECT, so it bypasses both stdio and the page cache */
+#define DIRECT_POOL_SIZE 8
+
+/* Reads and writes the image with O_DIRECT, one aligned physical block at a
+    time, through a per-disk pool of aligned buffers. Writes stay in the pool
+    until their buffer is reused or the disk is closed, and still reach the
+    image in the order they were made: buffers go out oldest write first,
+    and writing a dirty buffer again after another buffer was dirtied
+    writes them all back before it takes the new write. Falls back to normal
+    I/O on file systems that refuse O_DIRECT, such as tmpfs. The pools of
+    closed disks are kept and handed to the next disks opened
+   Select it with setDiskBackend(&directDiskOps) */
+extern const diskops directDiskOps;
+
+/* Sets the physical block size of direct disks opened from now on. It must
+    be a power of two from BLOCKSIZE to MAX_DISK_SIZE bytes
+   Returns 0, or OPEN_FAILURE if bytes is not a valid size */
+int setPhysBlockSize(int bytes);
+
+#endif
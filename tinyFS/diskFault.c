@@ -0,0 +1,92 @@
+#include "diskFault.h"
+#include "TinyFS.h"
+#include <unistd.h>
+
+static faultplan plan;
+static long reads = 0;
+static long writes = 0;
+
+void setFaultPlan(const faultplan *newplan) {
+   if(newplan)
+      plan = *newplan;
+   else
+      memset(&plan, 0, sizeof(faultplan));
+   reads = 0;
+   writes = 0;
+}
+
+long faultWrites(void) {
+   return writes;
+}
+
+int faultCrashed(void) {
+   return plan.crashafter > 0 && writes >= plan.crashafter;
+}
+
+static const diskops *below() {
+   return plan.below ? plan.below : &stdioDiskOps;
+}
+
+static void delay(int micros) {
+   struct timespec pause;
+
+   if(micros <= 0)
+      return;
+   pause.tv_sec = micros / 1000000;
+   pause.tv_nsec = micros % 1000000 * 1000L;
+   nanosleep(&pause, NULL);
+}
+
+static int faultopen(Disk *disk, char *filename, int nBytes) {
+   return below()->open(disk, filename, nBytes);
+}
+
+static int faultread(Disk *disk, int bNum, void *block) {
+   delay(plan.readdelay);
+   if(plan.readfail > 0 && ++reads % plan.readfail == 0)
+      return READ_ERROR;
+   return below()->read(disk, bNum, block);
+}
+
+static int faultwrite(Disk *disk, int bNum, void *block) {
+   uchar torn[BLOCKSIZE];
+   int error;
+
+   delay(plan.writedelay);
+   if(faultCrashed()) {
+      writes++;
+      return WRITE_ERROR;
+   }
+   writes++;
+   if(plan.crashafter > 0 && writes == plan.crashafter && plan.torn) {
+      // Half the new block over whatever was there before
+      if(below()->read(disk, bNum, torn) != 0)
+         memset(torn, 0, BLOCKSIZE);
+      memcpy(torn, block, BLOCKSIZE / 2);
+      below()->write(disk, bNum, torn);
+      if(plan.exitcrash)
+         _exit(0);
+      return WRITE_ERROR;
+   }
+   if(plan.writefail > 0 && writes % plan.writefail == 0)
+      return WRITE_ERROR;
+   error = below()->write(disk, bNum, block);
+   if(plan.exitcrash && faultCrashed())
+      _exit(0);
+   return error;
+}
+
+static int faultclose(Disk *disk) {
+   return below()->close(disk);
+}
+
+static int faultdiscard(Disk *disk, int bNum, int count) {
+   if(faultCrashed())
+      return WRITE_ERROR;
+   if(!below()->discard)
+      return 0;
+   return below()->discard(disk, bNum, count);
+}
+
+const diskops faultDiskOps = {faultopen, faultread, faultwrite, faultclose,
+                              faultdiscard};
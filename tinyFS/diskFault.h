@@ -0,0 +1,46 @@
+#ifndef DISKFAULT_H
+#define DISKFAULT_H
+
+#include "libDisk.h"
+
+/* What the fault injecting backend does to the disks opened through it */
+typedef struct faultplan {
+   /* Microseconds added to every block read and write */
+   int readdelay;
+   int writedelay;
+   /* Every readfail-th read and writefail-th write fails with READ_ERROR or
+      WRITE_ERROR without touching the image; 0 never fails */
+   int readfail;
+   int writefail;
+   /* After crashafter writes the disk stops: later writes are dropped and
+      fail, as if power was lost; 0 never crashes */
+   long crashafter;
+   /* The write the crash happens on lands torn, only its first half reaching
+      the image */
+   int torn;
+   /* The process exits right after the write the crash happens on, instead
+      of dropping the later writes, so whatever the backend below still
+      buffers is lost as it would be when the power goes */
+   int exitcrash;
+   /* Backend the I/O goes through, NULL for stdio */
+   const diskops *below;
+} faultplan;
+
+/* Passes block I/O through to the backend of the plan set with setFaultPlan,
+    stdio by default, injecting the faults of the plan. The counts are shared
+    by every disk opened through it
+   Select it with setDiskBackend(&faultDiskOps) */
+extern const diskops faultDiskOps;
+
+/* Replaces the fault plan and starts counting reads and writes from 0. A NULL
+    plan injects nothing */
+void setFaultPlan(const faultplan *plan);
+
+/* Returns the number of writes made since the plan was set, dropped ones
+    included */
+long faultWrites(void);
+
+/* Returns TRUE once the disk has crashed */
+int faultCrashed(void);
+
+#endif
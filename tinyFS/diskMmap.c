@@ -0,0 +1,62 @@
+#include "diskMmap.h"
+#include "TinyFS.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int mmapopen(Disk *disk, char *filename, int nBytes) {
+   struct stat info;
+   void *image;
+   int fd;
+
+   if (nBytes > 0)
+      return READ_ONLY_FS;
+   if ((fd = open(filename, O_RDONLY)) < 0)
+      return OPEN_FAILURE;
+   if (fstat(fd, &info) != 0 || info.st_size < BLOCKSIZE) {
+      close(fd);
+      return OPEN_FAILURE;
+   }
+   image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   // The mapping stays valid without the descriptor
+   close(fd);
+   if (image == MAP_FAILED)
+      return OPEN_FAILURE;
+
+   disk->size = info.st_size;
+   disk->state = image;
+   return 0;
+}
+
+static int mmapread(Disk *disk, int bNum, void *block) {
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return READ_ERROR;
+   memcpy(block, (char *)disk->state + bNum * BLOCKSIZE, BLOCKSIZE);
+   return 0;
+}
+
+static int mmapwrite(Disk *disk, int bNum, void *block) {
+   (void)disk;
+   (void)bNum;
+   (void)block;
+   return READ_ONLY_FS;
+}
+
+/* Discarding would change what the image reads back, so it is a write too */
+static int mmapdiscard(Disk *disk, int bNum, int count) {
+   (void)disk;
+   (void)bNum;
+   (void)count;
+   return READ_ONLY_FS;
+}
+
+static int mmapclose(Disk *disk) {
+   int error = munmap(disk->state, disk->size);
+
+   disk->state = NULL;
+   return error ? DISK_CLOSE_FAILURE : 0;
+}
+
+const diskops mmapDiskOps = {mmapopen, mmapread, mmapwrite, mmapclose,
+                             mmapdiscard};
@@ -0,0 +1,13 @@
+#ifndef DISKMMAP_H
+#define DISKMMAP_H
+
+#include "libDisk.h"
+
+/* Maps an existing image read-only and shared, so every process reading the
+    same image reads the same page cache pages and no process keeps a copy.
+    Reads are copies out of the mapping; writes, discards and opening with
+    nBytes > 0 fail with READ_ONLY_FS. tfs_mountReadOnly() opens images
+    through it */
+extern const diskops mmapDiskOps;
+
+#endif
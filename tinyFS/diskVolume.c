@@ -0,0 +1,449 @@
+#include "diskVolume.h"
+#include "TinyFS.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct volume;
+
+/* Writes one mirror member's copy of each block, so every member is
+   written at once */
+typedef struct writer {
+   struct volume *vol;
+   int index;
+   pthread_t thread;
+   /* What the member's write of the last block returned */
+   int result;
+} writer;
+
+typedef struct volume {
+   int mirrored;
+   int count;
+   /* Stripe unit in blocks */
+   int unit;
+   Disk members[VOLUME_MAX_MEMBERS];
+   /* Mirror members that missed a write, and so hold old blocks */
+   int stale[VOLUME_MAX_MEMBERS];
+   /* Each mirror member's record, "<member>.mirror", of the last epoch it
+      was in sync at. Every time members go stale the ones left move on to
+      a new epoch, so a stale member is still known when it is reopened */
+   char *records[VOLUME_MAX_MEMBERS];
+   int epoch;
+   writer writers[VOLUME_MAX_MEMBERS];
+   /* Number of writers started */
+   int started;
+   /* The block being written, handed to the writers under lock. Each new
+      block bumps round, and writing counts the writers yet to finish */
+   pthread_mutex_t lock;
+   pthread_cond_t queued;
+   pthread_cond_t written;
+   unsigned long round;
+   int writing;
+   int stopping;
+   int bNum;
+   void *block;
+} volume;
+
+static int stripeblocks = DEFAULT_STRIPE_BLOCKS;
+
+int setStripeBlocks(int blocks) {
+   if (blocks <= 0)
+      return OPEN_FAILURE;
+   stripeblocks = blocks;
+   return 0;
+}
+
+/* Splits the comma separated list in names into names[], in place. Returns
+   the number of members, or OPEN_FAILURE if there are none or too many */
+static int splitnames(char *names, char **members) {
+   int count = 0;
+
+   while (*names) {
+      if (count == VOLUME_MAX_MEMBERS)
+         return OPEN_FAILURE;
+      members[count++] = names;
+      names += strcspn(names, ",");
+      if (*names)
+         *names++ = '\0';
+   }
+   return count ? count : OPEN_FAILURE;
+}
+
+static void closemembers(volume *vol, int count) {
+   while (count-- > 0)
+      stdioDiskOps.close(&vol->members[count]);
+}
+
+/* Returns the epoch in record, 0 if there is none yet, or OPEN_FAILURE if
+   it can't be read */
+static int readepoch(char *record) {
+   FILE *file = fopen(record, "r");
+   int epoch;
+
+   if (!file)
+      return errno == ENOENT ? 0 : OPEN_FAILURE;
+   if (fscanf(file, "%d", &epoch) != 1 || epoch < 0)
+      epoch = OPEN_FAILURE;
+   fclose(file);
+   return epoch;
+}
+
+/* Returns 0 once epoch is in record, or WRITE_ERROR */
+static int writeepoch(char *record, int epoch) {
+   FILE *file = fopen(record, "w");
+   int error = 0;
+
+   if (!file)
+      return WRITE_ERROR;
+   if (fprintf(file, "%d\n", epoch) < 0 || fflush(file) != 0 ||
+       fsync(fileno(file)) != 0)
+      error = WRITE_ERROR;
+   if (fclose(file) != 0)
+      error = WRITE_ERROR;
+   return error;
+}
+
+/* Names each member's record and reads them, marking stale every member
+   behind the latest epoch. A new volume starts over with no records.
+   Returns 0, or OPEN_FAILURE if a record can't be named, read or cleared */
+static int readrecords(volume *vol, char **members, char *filename,
+                       int fresh) {
+   int epochs[VOLUME_MAX_MEMBERS];
+   int i;
+
+   vol->epoch = 0;
+   for (i = 0; i < vol->count; i++) {
+      vol->records[i] = malloc(strlen(members[i]) + sizeof(".mirror"));
+      if (!vol->records[i])
+         return OPEN_FAILURE;
+      sprintf(vol->records[i], "%s.mirror", members[i]);
+      if (fresh) {
+         if (remove(vol->records[i]) != 0 && errno != ENOENT)
+            return OPEN_FAILURE;
+         epochs[i] = 0;
+      }
+      else if ((epochs[i] = readepoch(vol->records[i])) < 0)
+         return OPEN_FAILURE;
+      if (epochs[i] > vol->epoch)
+         vol->epoch = epochs[i];
+   }
+   for (i = 0; i < vol->count; i++) {
+      if (epochs[i] < vol->epoch) {
+         vol->stale[i] = TRUE;
+         fprintf(stderr, "Mirror \"%s\": member %d is stale, not used\n",
+                 filename, i);
+      }
+   }
+   return 0;
+}
+
+/* Waits for each new block and writes it to its member, unless the member
+   is stale */
+static void *memberwrite(void *arg) {
+   writer *self = arg;
+   volume *vol = self->vol;
+   unsigned long seen = 0;
+   int result;
+
+   pthread_mutex_lock(&vol->lock);
+   while (TRUE) {
+      while (vol->round == seen && !vol->stopping)
+         pthread_cond_wait(&vol->queued, &vol->lock);
+      if (vol->stopping)
+         break;
+      seen = vol->round;
+      if (vol->stale[self->index])
+         continue;
+      pthread_mutex_unlock(&vol->lock);
+      result = stdioDiskOps.write(&vol->members[self->index], vol->bNum,
+                                  vol->block);
+      pthread_mutex_lock(&vol->lock);
+      self->result = result;
+      if (--vol->writing == 0)
+         pthread_cond_signal(&vol->written);
+   }
+   pthread_mutex_unlock(&vol->lock);
+   return NULL;
+}
+
+static void stopwriters(volume *vol) {
+   int i;
+
+   pthread_mutex_lock(&vol->lock);
+   vol->stopping = TRUE;
+   pthread_cond_broadcast(&vol->queued);
+   pthread_mutex_unlock(&vol->lock);
+   for (i = 0; i < vol->started; i++)
+      pthread_join(vol->writers[i].thread, NULL);
+   vol->started = 0;
+}
+
+/* Returns 0 once every member has its writer, or OPEN_FAILURE */
+static int startwriters(volume *vol) {
+   int i;
+
+   for (i = 0; i < vol->count; i++) {
+      vol->writers[i].vol = vol;
+      vol->writers[i].index = i;
+      if (pthread_create(&vol->writers[i].thread, NULL, memberwrite,
+                         &vol->writers[i]) != 0) {
+         stopwriters(vol);
+         return OPEN_FAILURE;
+      }
+      vol->started++;
+   }
+   return 0;
+}
+
+static void freevolume(volume *vol) {
+   int i;
+
+   for (i = 0; i < vol->count; i++)
+      free(vol->records[i]);
+   pthread_mutex_destroy(&vol->lock);
+   pthread_cond_destroy(&vol->queued);
+   pthread_cond_destroy(&vol->written);
+   free(vol);
+}
+
+/* Opens every member, each sized to hold its share of nBytes if the volume
+   is new, and sets the size of the volume from what the members hold */
+static int volumeopen(Disk *disk, char *filename, int nBytes, int mirrored) {
+   char *members[VOLUME_MAX_MEMBERS];
+   volume *vol = calloc(1, sizeof(volume));
+   char *names = strdup(filename);
+   int stripe;
+   int membersize = 0;
+   int smallest = 0;
+   int i;
+
+   if (!vol || !names || (vol->count = splitnames(names, members)) < 0) {
+      free(vol);
+      free(names);
+      return OPEN_FAILURE;
+   }
+   pthread_mutex_init(&vol->lock, NULL);
+   pthread_cond_init(&vol->queued, NULL);
+   pthread_cond_init(&vol->written, NULL);
+   vol->mirrored = mirrored;
+   vol->unit = stripeblocks;
+   stripe = vol->unit * BLOCKSIZE * (mirrored ? 1 : vol->count);
+
+   if (nBytes > 0) {
+      nBytes = (nBytes + stripe - 1) / stripe * stripe;
+      membersize = mirrored ? nBytes : nBytes / vol->count;
+   }
+   for (i = 0; i < vol->count; i++) {
+      if (stdioDiskOps.open(&vol->members[i], members[i], membersize) != 0) {
+         closemembers(vol, i);
+         freevolume(vol);
+         free(names);
+         return OPEN_FAILURE;
+      }
+      if (!i || vol->members[i].size < smallest)
+         smallest = vol->members[i].size;
+   }
+   if (mirrored && (readrecords(vol, members, filename, nBytes > 0) != 0 ||
+                    startwriters(vol) != 0)) {
+      closemembers(vol, vol->count);
+      freevolume(vol);
+      free(names);
+      return OPEN_FAILURE;
+   }
+   free(names);
+
+   // A volume is as big as its smallest member allows
+   if (mirrored)
+      disk->size = smallest;
+   else
+      disk->size = smallest / (vol->unit * BLOCKSIZE) * stripe;
+   disk->state = vol;
+   return 0;
+}
+
+static int stripeopen(Disk *disk, char *filename, int nBytes) {
+   return volumeopen(disk, filename, nBytes, FALSE);
+}
+
+static int mirroropen(Disk *disk, char *filename, int nBytes) {
+   return volumeopen(disk, filename, nBytes, TRUE);
+}
+
+/* Returns the member striped block bNum lives on, and its block number
+   there in memberblock */
+static Disk *locate(volume *vol, int bNum, int *memberblock) {
+   int unit = bNum / vol->unit;
+
+   *memberblock = unit / vol->count * vol->unit + bNum % vol->unit;
+   return &vol->members[unit % vol->count];
+}
+
+static int striperead(Disk *disk, int bNum, void *block) {
+   int memberblock;
+   Disk *member;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return READ_ERROR;
+   member = locate(disk->state, bNum, &memberblock);
+   return stdioDiskOps.read(member, memberblock, block);
+}
+
+static int stripewrite(Disk *disk, int bNum, void *block) {
+   int memberblock;
+   Disk *member;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return WRITE_ERROR;
+   member = locate(disk->state, bNum, &memberblock);
+   return stdioDiskOps.write(member, memberblock, block);
+}
+
+/* Discards the range one stripe unit at a time, since neighbouring units
+   are on different members */
+static int stripediscard(Disk *disk, int bNum, int count) {
+   int memberblock;
+   int length;
+   int error = 0;
+   Disk *member;
+   volume *vol = disk->state;
+
+   while (count > 0) {
+      length = vol->unit - bNum % vol->unit;
+      if (length > count)
+         length = count;
+      member = locate(vol, bNum, &memberblock);
+      if (stdioDiskOps.discard(member, memberblock, length) != 0)
+         error = WRITE_ERROR;
+      bNum += length;
+      count -= length;
+   }
+   return error;
+}
+
+static int mirrorread(Disk *disk, int bNum, void *block) {
+   volume *vol = disk->state;
+   int first = bNum / vol->unit % vol->count;
+   int member;
+   int i;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return READ_ERROR;
+   for (i = 0; i < vol->count; i++) {
+      member = (first + i) % vol->count;
+      if (!vol->stale[member] &&
+          stdioDiskOps.read(&vol->members[member], bNum, block) == 0)
+         return 0;
+   }
+   return READ_ERROR;
+}
+
+/* Moves the members still in sync on to a new epoch, leaving the ones just
+   marked stale behind. A member whose record can't be written is left
+   behind too. Returns 0, or WRITE_ERROR if no record could be written, as
+   the stale members would then look in sync once reopened */
+static int recordstale(Disk *disk) {
+   volume *vol = disk->state;
+   int unrecorded[VOLUME_MAX_MEMBERS] = {0};
+   int recorded = 0;
+   int i;
+
+   vol->epoch++;
+   for (i = 0; i < vol->count; i++) {
+      if (vol->stale[i])
+         continue;
+      if (writeepoch(vol->records[i], vol->epoch) == 0)
+         recorded++;
+      else
+         unrecorded[i] = TRUE;
+   }
+   if (!recorded)
+      return WRITE_ERROR;
+
+   for (i = 0; i < vol->count; i++) {
+      if (unrecorded[i]) {
+         vol->stale[i] = TRUE;
+         fprintf(stderr, "Mirror \"%s\": member %d could not be recorded in "
+                 "sync, no longer used\n", disk->name, i);
+      }
+   }
+   return 0;
+}
+
+/* Hands the block to every writer of a member still in sync and waits for
+   them all. The members that fail while others take the block are marked
+   stale, in memory and in the records, and left out from then on; if none
+   take it, they all still agree and the write fails */
+static int mirrorwrite(Disk *disk, int bNum, void *block) {
+   volume *vol = disk->state;
+   int failed = FALSE;
+   int written = 0;
+   int i;
+
+   if (bNum < 0 || (bNum + 1) * BLOCKSIZE > disk->size)
+      return WRITE_ERROR;
+   pthread_mutex_lock(&vol->lock);
+   vol->bNum = bNum;
+   vol->block = block;
+   vol->writing = 0;
+   for (i = 0; i < vol->count; i++) {
+      if (!vol->stale[i])
+         vol->writing++;
+   }
+   vol->round++;
+   pthread_cond_broadcast(&vol->queued);
+   while (vol->writing > 0)
+      pthread_cond_wait(&vol->written, &vol->lock);
+   pthread_mutex_unlock(&vol->lock);
+
+   for (i = 0; i < vol->count; i++) {
+      if (!vol->stale[i] && vol->writers[i].result == 0)
+         written++;
+   }
+   if (!written)
+      return WRITE_ERROR;
+
+   for (i = 0; i < vol->count; i++) {
+      if (!vol->stale[i] && vol->writers[i].result != 0) {
+         vol->stale[i] = TRUE;
+         failed = TRUE;
+         fprintf(stderr, "Mirror \"%s\": member %d missed block %d, no longer "
+                 "used\n", disk->name, i, bNum);
+      }
+   }
+   return failed ? recordstale(disk) : 0;
+}
+
+static int mirrordiscard(Disk *disk, int bNum, int count) {
+   volume *vol = disk->state;
+   int error = 0;
+   int i;
+
+   for (i = 0; i < vol->count; i++) {
+      if (!vol->stale[i] &&
+          stdioDiskOps.discard(&vol->members[i], bNum, count) != 0)
+         error = WRITE_ERROR;
+   }
+   return error;
+}
+
+static int volumeclose(Disk *disk) {
+   volume *vol = disk->state;
+   int error = 0;
+   int i;
+
+   if (vol->mirrored)
+      stopwriters(vol);
+   for (i = 0; i < vol->count; i++) {
+      if (stdioDiskOps.close(&vol->members[i]) != 0)
+         error = DISK_CLOSE_FAILURE;
+   }
+   freevolume(vol);
+   disk->state = NULL;
+   return error;
+}
+
+const diskops stripeDiskOps = {stripeopen, striperead, stripewrite, volumeclose,
+                               stripediscard};
+
+const diskops mirrorDiskOps = {mirroropen, mirrorread, mirrorwrite, volumeclose,
+                               mirrordiscard};
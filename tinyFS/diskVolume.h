@@ -0,0 +1,41 @@
+#ifndef DISKVOLUME_H
+#define DISKVOLUME_H
+
+#include "libDisk.h"
+
+/* Most images one volume can span */
+#define VOLUME_MAX_MEMBERS 8
+/* Default number of blocks in one stripe unit, 1 KiB */
+#define DEFAULT_STRIPE_BLOCKS 4
+
+/* Both backends take a comma separated list of member images as the file
+    name, "a.dsk,b.dsk,c.dsk", and reach each member through stdio. A volume
+    must be opened with the same members, in the same order, and the same
+    stripe unit it was made with */
+
+/* Stripes the disk over its members RAID-0 style: the blocks go out in
+    units of setStripeBlocks() blocks to each member in turn, so a run of
+    blocks is spread over every member. A new volume is rounded up to whole
+    stripes
+   Select it with setDiskBackend(&stripeDiskOps) */
+extern const diskops stripeDiskOps;
+
+/* Mirrors the disk on every member RAID-1 style. Writes go to every member
+    at once, one thread per member, and fail only if all of them fail. A
+    member that fails a write the others took is reported on stderr and
+    marked stale: the volume runs degraded, reading and writing the other
+    members only. The mark is kept in a record beside each member,
+    "<member>.mirror", so a stale member stays left out when the volume is
+    reopened, until its image and record are replaced by copies of a good
+    member's. A new volume starts with no records. Reads
+    are balanced by giving each member its own share of the stripe units,
+    so the members cache different blocks, and fall back to the other
+    members if one can't be read
+   Select it with setDiskBackend(&mirrorDiskOps) */
+extern const diskops mirrorDiskOps;
+
+/* Sets the stripe unit of volumes opened from now on, in blocks
+   Returns 0, or OPEN_FAILURE if blocks is not positive */
+int setStripeBlocks(int blocks);
+
+#endif
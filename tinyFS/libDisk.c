@@ -1,72 +1,203 @@
+#define _GNU_SOURCE
 #include "libDisk.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static Disk *disk_list = NULL;
 static Disk *curr = NULL;
 static Disk *endptr = NULL;
 static int open_disks = 0;
+/* Disks ever created; disk numbers are positions in disk_list */
+static int num_disks = 0;
 
-int openDisk(char *filename, int nBytes) {
+static const diskops *backend = &stdioDiskOps;
+static diskstats stats;
+
+static int stdioopen(Disk *disk, char *filename, int nBytes) {
    FILE *fd = NULL;
-   int disk_num;
-     
+
    if (nBytes > 0) {
+      // New images are sized in whole blocks without writing them, so
+      // blocks nothing has written yet read back as zeros
+      nBytes = (nBytes + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
       fd = fopen(filename, "w+b");
+      if (fd && ftruncate(fileno(fd), nBytes) != 0) {
+         fclose(fd);
+         return OPEN_FAILURE;
+      }
+   }
+   else {
+      // Existing disks are opened for update and keep their current size
+      fd = fopen(filename, "r+b");    
+      if (fd && fseek(fd, 0, SEEK_END) == 0)
+         nBytes = ftell(fd);
+   }
+   if (!fd)
+      return OPEN_FAILURE;
+   disk->file = fd;
+   disk->size = nBytes;
+   return 0;
+}
+
+static int stdioread(Disk *disk, int bNum, void *block) {
+   FILE *fd = disk->file;
+
+   if (fseek(fd, bNum * BLOCKSIZE, SEEK_SET) == 0) {
+      if (fread(block, BLOCKSIZE, 1, fd) > 0)
+         return 0;
+   }
+   return READ_ERROR;
+}
+
+static int stdiowrite(Disk *disk, int bNum, void *block) {
+   FILE *fd = disk->file;
+
+   if (fseek(fd, bNum * BLOCKSIZE, SEEK_SET) == 0) {
+      if (fwrite(block, BLOCKSIZE, 1, fd) > 0)
+         return 0;
+   }
+   return WRITE_ERROR;
+}
+
+static int stdioclose(Disk *disk) {
+   int error = 0;
+
+   if (fflush(disk->file) != 0) {
+      printf("Flushing data failed\n");
+      error = DISK_CLOSE_FAILURE;
+   }
+   fclose(disk->file);
+   return error;
+}
+
+int punchHole(int fd, int bNum, int count) {
+   // Disk images on file systems without holes just keep the blocks
+   if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 (off_t)bNum * BLOCKSIZE, (off_t)count * BLOCKSIZE) != 0 &&
+       errno != EOPNOTSUPP && errno != ENOSYS)
+      return WRITE_ERROR;
+   return 0;
+}
+
+static int stdiodiscard(Disk *disk, int bNum, int count) {
+   // Buffered writes must reach the file first, or they would refill the hole
+   if (fflush(disk->file) != 0)
+      return WRITE_ERROR;
+   return punchHole(fileno(disk->file), bNum, count);
+}
+
+const diskops stdioDiskOps = {stdioopen, stdioread, stdiowrite, stdioclose,
+                              stdiodiscard};
+
+void setDiskBackend(const diskops *ops) {
+   backend = ops ? ops : &stdioDiskOps;
+}
+
+/* Returns a closed disk record with room for a name of namesize bytes and
+   stores its disk number in disknum, or NULL if there is none */
+static Disk *closeddisk(int namesize, int *disknum) {
+   Disk *temp;
+   int index = 0;
+
+   for (temp = disk_list; temp; temp = temp->next, index++) {
+      if (!temp->open && temp->namesize >= namesize) {
+         *disknum = index;
+         return temp;
+      }
+   }
+   return NULL;
+}
+
+int openDisk(char *filename, int nBytes) {
+   return openDiskWith(filename, nBytes, backend);
+}
+
+int openDiskWith(char *filename, int nBytes, const diskops *ops) {
+   int namesize = strlen(filename) + 1;
+   int disknum = num_disks;
+   Disk *add = closeddisk(namesize, &disknum);
+   Disk *next;
+
+   // Closed records are recycled, so opening and closing disks over and
+   // over doesn't grow the list
+   if (add) {
+      next = add->next;
+      namesize = add->namesize;
+      memset(add, 0, sizeof(Disk));
+      add->next = next;
    }
    else {
-      fd = fopen(filename, "rb");    
+      namesize = (namesize + DISK_NAME_ROUND - 1) / DISK_NAME_ROUND * DISK_NAME_ROUND;
+      // The name is stored in the same allocation as the record
+      if ((add = calloc(1, sizeof(Disk) + namesize)) == NULL)
+         return OPEN_FAILURE;
    }
-   assert(fd);
-   disk_num = createDisk(filename, nBytes, fd); 
+   add->name = (char *)(add + 1);
+   add->namesize = namesize;
+   add->ops = ops;
+   if (add->ops->open(add, filename, nBytes) != 0) {
+      if (disknum == num_disks)
+         free(add);
+      return OPEN_FAILURE;
+   }
+   strcpy(add->name, filename);
+   add->open = 1;
+   open_disks++;
    //printf("Open success!\n");
-   return disk_num;
+   if (disknum == num_disks)
+      return createDisk(add);
+   return disknum;
 }
 
 int readBlock(int disk, int bNum, void *block) {
    Disk *temp = NULL;
-   FILE *fd = NULL;
-   int read = 0;
 
    //fprintf(stderr, "Reading Block %d\n", bNum);
    if ((temp = findDisk(disk)) == NULL) {
       printf("Failed here!\n");
       return OPEN_FAILURE;
    }
-   //fprintf(stderr, "Found disk \n");
-   //fprintf(stderr, "File name of disk: %s\n", temp->name);
    if (temp->open == 0)
       return CLOSED_DISK_FAILURE;
    
-   //fprintf(stderr, "Disk is open \n");
-   fd = temp->file;
-   if (fseek(fd, bNum * BLOCKSIZE, SEEK_SET) == 0) {
-      
-   //fprintf(stderr, "Seeked \n");
-      read = fread(block, BLOCKSIZE, 1, fd);
-   //fprintf(stderr, "Read %d elements from disk \n", read);
-      if (read > 0)
-         return 0;
-   }
-   return READ_ERROR;
+   stats.reads++;
+   return temp->ops->read(temp, bNum, block);
 }
 
 int writeBlock(int disk, int bNum, void *block){
    Disk *temp;
-   FILE *fd;
-   int write;
 
    if ((temp = findDisk(disk)) == NULL)
       return OPEN_FAILURE;
    if (temp->open == 0)
       return CLOSED_DISK_FAILURE;
 
-   fd = temp->file;
-   if (fseek(fd, bNum * BLOCKSIZE, SEEK_SET) == 0) {
-      write = fwrite(block, BLOCKSIZE, 1, fd);
-      if (write > 0)
-         return 0;
-   }
-   return WRITE_ERROR;
+   stats.writes++;
+   return temp->ops->write(temp, bNum, block);
+}
+
+int discardBlocks(int disk, int bNum, int count) {
+   Disk *temp;
+
+   if ((temp = findDisk(disk)) == NULL)
+      return OPEN_FAILURE;
+   if (temp->open == 0)
+      return CLOSED_DISK_FAILURE;
+   if (count <= 0 || !temp->ops->discard)
+      return 0;
+
+   stats.discards++;
+   return temp->ops->discard(temp, bNum, count);
+}
+
+void getDiskStats(diskstats *copy) {
+   *copy = stats;
+}
+
+void resetDiskStats(void) {
+   memset(&stats, 0, sizeof(diskstats));
 }
 
 void closeDisk(int disk) {
@@ -76,11 +207,11 @@ void closeDisk(int disk) {
       printf("Invalid disk to close\n");
       return;
    }
-   if (fflush(temp->file) != 0)
-      printf("Flushing data failed\n");
+   if (!temp->open)
+      return;
 
+   temp->ops->close(temp);
    temp->open = 0;
-   fclose(temp->file);
    open_disks--;
 }
 
@@ -88,7 +219,7 @@ int findFile(char *filename) {
    int disk_lookup = 0;
    curr = disk_list;
    while (curr) {
-      if (strcmp(filename, curr->name) == 0)
+      if (curr->open && strcmp(filename, curr->name) == 0)
          return disk_lookup;
       disk_lookup++;
       curr = curr->next;
@@ -97,15 +228,7 @@ int findFile(char *filename) {
    return OPEN_FAILURE;
 }
 
-int createDisk(char *filename, int nBytes, FILE *fd) {
-   Disk *add = calloc(1, sizeof(Disk));
-
-   add->size = nBytes;
-   add->name = calloc(strlen(filename) + 1, sizeof(char));
-   strcpy(add->name, filename);
-   add->open = 1;
-   add->file = fd;
-
+int createDisk(Disk *add) {
    if (disk_list == NULL) {
       disk_list = add;
    }
@@ -114,7 +237,7 @@ int createDisk(char *filename, int nBytes, FILE *fd) {
    }
    endptr = add;
 
-   return open_disks++;
+   return num_disks++;
 }
 
 Disk *findDisk(int index) {
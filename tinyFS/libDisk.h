@@ -9,14 +9,39 @@
 
 #define BLOCKSIZE 256
 
+struct diskops;
+
+/* Disk names are allocated in multiples of this many bytes, so a closed
+disk's record can usually be reused for the next one opened */
+#define DISK_NAME_ROUND 32
+
 typedef struct Disk {
    char *name;
+   int namesize;
    int size;
    int open;
    FILE *file;
+   /* Private state of backends other than stdio */
+   void *state;
+   const struct diskops *ops;
    struct Disk *next;
 }Disk;
 
+/* Block I/O backend of a disk. open sets up disk for filename, formatting
+nBytes of it if nBytes > 0 or using the existing file otherwise, and sets
+disk->size. The rest work like the functions of the same name below, discard
+may be NULL if the backend can't release space. All return 0 on success */
+typedef struct diskops {
+   int (*open)(Disk *disk, char *filename, int nBytes);
+   int (*read)(Disk *disk, int bNum, void *block);
+   int (*write)(Disk *disk, int bNum, void *block);
+   int (*close)(Disk *disk);
+   int (*discard)(Disk *disk, int bNum, int count);
+} diskops;
+
+/* Reads and writes through stdio, the default */
+extern const diskops stdioDiskOps;
+
 /* This functions opens a regular UNIX file and designates the first nBytes of it as space for the
 emulated disk. nBytes should be an integral number of the block size. If nBytes > 0 and there is already
 a file by the given filename, that files contents may be overwritten. If nBytes is 0, an existing disk
@@ -24,6 +49,10 @@ is opened, and should not be overwritten. There is no requirement to maintain in
 beyond nBytes. The return value is -1 on failure or a disk number on success. */
 int openDisk(char *filename, int nBytes);
 
+/* Same as openDisk(), through backend ops instead of the one selected with
+setDiskBackend() */
+int openDiskWith(char *filename, int nBytes, const diskops *ops);
+
 /* readBlock() reads an entire block of BLOCKSIZE bytes from the open disk (identified by disk)
 and copies the result into a local buffer (must be at least of BLOCKSIZE bytes). The bNum is a logical
 block number, which must be translated into a byte offset within the disk. The translation from logical
@@ -41,16 +70,45 @@ disk is not available (i.e. hasn
 error code system. */
 int writeBlock(int disk, int bNum, void *block);
 
+/* discardBlocks() tells the disk that the count blocks starting at bNum hold nothing
+worth keeping, so the space behind them can be released. The stdio and direct
+backends punch a hole in the image file, which then reads back as zeros. It is
+only advice: backends that can't release space, or file systems that don't
+support holes, leave the blocks as they are and return 0. */
+int discardBlocks(int disk, int bNum, int count);
+
+/* Punches a hole over count blocks starting at bNum of the image open as fd,
+for backends' discard. Returns 0 if the file system doesn't support holes */
+int punchHole(int fd, int bNum, int count);
+
 /* closeDisk() takes a disk number disk and makes the disk closed to further I/O; 
 i.e. any subsequent reads or writes to a closed disk should return an error. 
 Closing a disk should also close the underlying file, committing any buffered writes. */
 void closeDisk(int disk);
 
-// Checks linked list for filename and returns position if found
+// Checks linked list for an open disk named filename and returns position if found
 int findFile(char *filename);
 
-// Makes a new disk and returns its disk number
-int createDisk(char *filename, int nBytes, FILE *fd);
+// Adds a new opened disk to the end of the list and returns its disk number
+int createDisk(Disk *add);
+
+/* Selects the backend of disks opened from now on. Passing NULL selects
+stdio again. Disks already open keep their backend */
+void setDiskBackend(const diskops *ops);
+
+/* Blocks moved by readBlock() and writeBlock(), over every disk */
+typedef struct diskstats {
+   long reads;
+   long writes;
+   /* Runs passed to discardBlocks(), not blocks */
+   long discards;
+} diskstats;
+
+/* Copies the block reads and writes since the program started, or since the
+last resetDiskStats(), into stats */
+void getDiskStats(diskstats *stats);
+
+void resetDiskStats(void);
 
 // Finds the disk at the given index
 Disk *findDisk(int index);
@@ -1,9 +1,15 @@
 #include "libTinyFS.h"
+#include "crc32c.h"
+
+/* Metadata blocks of disk metadisk held in memory, see startMetaCache() */
+static int metadisk = -1;
+static uchar metacached[MAX_NUM_BLOCKS];
+static uchar metablocks[MAX_NUM_BLOCKS][BLOCKSIZE];
 
 static int checksuperblock(int disknum) {
-   uchar block[BLOCKSIZE] = {0};
+   uchar block[BLOCKSIZE];
    
-   if(readBlock(disknum, SUPERBLOCK_ADDR, block)) {
+   if(readCheckedBlock(disknum, SUPERBLOCK_ADDR, block)) {
       fprintf(stderr, "Superblock Failed Reading\n");
       return READ_ERROR;
    }
@@ -17,8 +23,8 @@ static int checksuperblock(int disknum) {
 }
 
 static int checkroot(int disknum) {
-   uchar block[BLOCKSIZE] = {0};
-   if(readBlock(disknum, ROOT_ADDR, block)) {
+   uchar block[BLOCKSIZE];
+   if(readCheckedBlock(disknum, ROOT_ADDR, block)) {
       fprintf(stderr, "Superblock Failed Reading\n");
       return READ_ERROR;
    }
@@ -38,102 +44,128 @@ static int checkroot(int disknum) {
    return 0;
 }
 
-static int checkmagicnum(int disknum) {
-   int loop = 0;
-   int numblocks = (getSize(disknum) - 1)/BLOCKSIZE + 1;
-   uchar block[BLOCKSIZE] = {0};
-
-   while(loop < numblocks) {
-      if(readBlock(disknum, loop, block)) {
-      fprintf(stderr, "Superblock Failed Reading\n");
-         return READ_ERROR;
-      }
-      if(block[1] != MAGIC_NUM) {
-         fprintf(stderr, "Failed MagicNumber Check\n");
-         return CORRUPT_FS;
-      }
-      loop++;
-   }
-   return 0;
-}
-
-static int checkusedblock(uchar disknum, uchar blocknum) {
-   uchar block[BLOCKSIZE] = {0};
-
-   readBlock(disknum, blocknum, block);
-   if(block[0] != SUPERBLOCK && block[0] != INODE && block[0] != FILE_EXTENT)
-      return CORRUPT_FS;
-   return 0;
+static int inuse(uchar *bitmap, int blocknum) {
+   return GETBIT(bitmap[blocknum / BITS_PER_BYTE], 7 - blocknum % BITS_PER_BYTE);
 }
 
-static int checkfreeblock(uchar disknum, uchar blocknum) {
-   uchar block[BLOCKSIZE] = {0};
-
-   readBlock(disknum, blocknum, block);
-   if(block[0] != FREE_BLOCK)
+/* Marks blocknum as reached in seen, failing if it is outside the disk, free
+    in the bitmap or already reached through another file */
+static int reach(uchar *seen, uchar *bitmap, int numblocks, int blocknum) {
+   if(blocknum <= ROOT_ADDR || blocknum >= numblocks || !inuse(bitmap, blocknum) ||
+      seen[blocknum]) {
+      fprintf(stderr, "Block %d Is Not Allocated To One File\n", blocknum);
       return CORRUPT_FS;
+   }
+   seen[blocknum] = TRUE;
    return 0;
 }
 
-static int checkbitmap(int disknum) {
-   int outer = 0;
-   int inner = 0;
-   uchar bitmap[BITMAP_SIZE] = {0};
-   int numblocks = (getSize(disknum) - 1) / BLOCKSIZE + 1;
-   int numbytes = (numblocks - 1) / BITS_PER_BYTE + 1;
-
-   getBitmap(disknum, bitmap);
+/* Reaches the inode at inodeblock and every block of its chain */
+static int checkfile(int disknum, uchar *seen, uchar *bitmap, int numblocks,
+                     int inodeblock) {
+   uchar block[BLOCKSIZE];
+   int blocknum = inodeblock;
+   int blocks = 0;
+   int xattrs = NULL_ADDR;
+   int type = INODE;
+   int count;
 
-   while(outer < BITMAP_SIZE && outer < numblocks) {
-      while(inner < BITS_PER_BYTE) {
-         if(GETBIT(bitmap[outer], (7 - inner))) {
-            if(checkusedblock(disknum, outer * BITS_PER_BYTE + inner))
-               return CORRUPT_FS;
-         }
-         else {
-            if(checkfreeblock(disknum, outer * BITS_PER_BYTE + inner))
-               return CORRUPT_FS;
-         }
-         inner++;
+   // The inode, its data blocks, then its attribute overflow block if any
+   for(count = -1; count <= blocks; count++) {
+      if(count == blocks) {
+         if(xattrs == NULL_ADDR)
+            break;
+         blocknum = xattrs;
+         type = XATTR_BLOCK;
       }
-      inner = 0;
-      outer++;
+      if(reach(seen, bitmap, numblocks, blocknum) ||
+         readCheckedBlock(disknum, blocknum, block) != 0 || block[0] != type) {
+         fprintf(stderr, "File At Block %d Failed Check\n", inodeblock);
+         return CORRUPT_FS;
+      }
+      if(count < 0) {
+         blocks = block[BLOCKS_INDEX];
+         xattrs = block[XATTR_BLOCK_INDEX];
+         type = FILE_EXTENT;
+      }
+      blocknum = block[2];
    }
-
    return 0;
 }
 
 static int namecmp(char *name, int disknum, uchar blocknum) {
    uchar block[BLOCKSIZE];
-   char filename[MAX_NAME_SIZE] = {'\0'};
+   char filename[MAX_NAME_SIZE + 1] = {'\0'};
+   int error = readCheckedBlock(disknum, blocknum, block);
+
+   if(error)
+      return error;
+   // Names fill all MAX_NAME_SIZE bytes when they are that long
+   memcpy(filename, block + NAME_INDEX, MAX_NAME_SIZE);
+
+   // Longer names are stored cut to MAX_NAME_SIZE, like findFD() compares them
+   return strncmp(name, filename, MAX_NAME_SIZE) != 0;
+}
 
-   readBlock(disknum, blocknum, block);
-   memcpy(filename, block + 4, MAX_NAME_SIZE);
+int diskBlocks(int disknum) {
+   int blocks = (getSize(disknum) - 1)/BLOCKSIZE + 1;
 
-   return strcmp(name, filename);
+   return blocks < MAX_NUM_BLOCKS ? blocks : MAX_NUM_BLOCKS;
 }
 
-/* Checks FS for Integrity */
+/* Checks FS for Integrity
+   Only the superblock and root are read here; every other block has its
+    magic number and checksum verified lazily by readCheckedBlock */
 int checkfs(int disknum) {
-   if(checksuperblock(disknum) || checkroot(disknum) || checkmagicnum(disknum))
+   if(checksuperblock(disknum) || checkroot(disknum))
       return CORRUPT_FS;
 
    return 0;
 }
 
+int checkBlocks(int disknum) {
+   uchar root[BLOCKSIZE];
+   uchar bitmap[BITMAP_SIZE];
+   uchar held[BITMAP_SIZE];
+   uchar seen[MAX_NUM_BLOCKS] = {0};
+   int numblocks = diskBlocks(disknum);
+   int leaked = 0;
+   int loop;
+   int error;
+
+   if(checkfs(disknum))
+      return CORRUPT_FS;
+   if((error = getBitmap(disknum, bitmap)) || (error = getHeldBitmap(disknum, held)) ||
+      (error = readCheckedBlock(disknum, ROOT_ADDR, root)))
+      return error;
+
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++) {
+      if(root[loop] != NULL_ADDR &&
+         checkfile(disknum, seen, bitmap, numblocks, root[loop]))
+         return CORRUPT_FS;
+   }
+
+   // Snapshots keep their own blocks, so only unheld ones can leak
+   for(loop = ROOT_ADDR + 1; loop < numblocks; loop++)
+      leaked += inuse(bitmap, loop) && !seen[loop] && !inuse(held, loop);
+   return leaked;
+}
+
 int nextFreeBlock(int disknum, int skip) {
-   uchar block[BLOCKSIZE] = {0};
+   uchar block[BLOCKSIZE];
    uchar addr = 0;
    int outer = BITMAP_FIRST_ADDR;
    int inner;
    
-   readBlock(disknum, SUPERBLOCK_ADDR, block);
-   while(outer < BLOCKSIZE) {
-      addr = block[outer];
+   if(readCheckedBlock(disknum, SUPERBLOCK_ADDR, block) != 0)
+      return READ_ERROR;
+   while(outer < BITMAP_FIRST_ADDR + BITMAP_SIZE) {
+      // blocks held by a snapshot are not free either
+      addr = block[outer] | block[outer - BITMAP_FIRST_ADDR + HELD_FIRST_ADDR];
       for(inner = 7; inner >= 0; inner--) {
          if(!GETBIT(addr, inner)) {
             if(!skip--)
-               return (outer - BITMAP_FIRST_ADDR) * sizeof(uchar) + (7 - inner);
+               return (outer - BITMAP_FIRST_ADDR) * BITS_PER_BYTE + (7 - inner);
          }
       }
       outer++;
@@ -142,12 +174,13 @@ int nextFreeBlock(int disknum, int skip) {
 }
 
 int nextRootAddrIndex(int disknum) {
-   uchar block[BLOCKSIZE] = {0};
+   uchar block[BLOCKSIZE];
    uchar addr = 0;
    int loop = ROOT_FIRST_ADDR;
    
-   readBlock(disknum, ROOT_ADDR, block);
-   while(loop < BLOCKSIZE) {
+   if(readCheckedBlock(disknum, ROOT_ADDR, block) != 0)
+      return READ_ERROR;
+   while(loop < CHECKSUM_INDEX) {
       addr = block[loop];
       if(!addr)
          return loop - 12;
@@ -157,15 +190,24 @@ int nextRootAddrIndex(int disknum) {
 }
 
 int getInodeBlock(char *name, int disknum) {
+   return findInodeBlock(name, disknum, ROOT_ADDR);
+}
+
+int findInodeBlock(char *name, int disknum, uchar root) {
    uchar block[BLOCKSIZE];
    uchar addr = 0;
    int loop = ROOT_FIRST_ADDR;
+   int cmp;
 
-   readBlock(disknum, ROOT_ADDR, block);
-   while(loop < BLOCKSIZE) {
+   if((cmp = readCheckedBlock(disknum, root, block)) != 0)
+      return cmp;
+   while(loop < CHECKSUM_INDEX) {
       addr = block[loop];
       if(addr) {
-         if(!namecmp(name, disknum, addr))
+         cmp = namecmp(name, disknum, addr);
+         if(cmp < 0)
+            return cmp;
+         if(!cmp)
             return addr;
       }
       loop++;
@@ -174,10 +216,113 @@ int getInodeBlock(char *name, int disknum) {
 }
 
 /* Fills bitmap with BITMAP_SIZE bytes of bitmap found in superblock */
-void getBitmap(int disknum, uchar *bitmap) {
-   uchar block[BLOCKSIZE] = {0};
+int getBitmap(int disknum, uchar *bitmap) {
+   uchar block[BLOCKSIZE];
+   int error = readCheckedBlock(disknum, SUPERBLOCK_ADDR, block);
 
-   readBlock(disknum, SUPERBLOCK_ADDR, block);
+   // An unreadable superblock reads as an empty bitmap
+   if(error)
+      memset(block, 0, BLOCKSIZE);
    memcpy(bitmap, block + 4, BITMAP_SIZE);
+   return error;
+}
+
+int getHeldBitmap(int disknum, uchar *held) {
+   uchar block[BLOCKSIZE];
+   int error = readCheckedBlock(disknum, SUPERBLOCK_ADDR, block);
+
+   if(error)
+      memset(block, 0, BLOCKSIZE);
+   memcpy(held, block + HELD_FIRST_ADDR, BITMAP_SIZE);
+   return error;
+}
+
+static uint32_t blockchecksum(uchar *block) {
+   return crc32c(0, block, CHECKSUM_INDEX);
+}
+
+static int cacheable(int disknum, int bNum) {
+   return disknum == metadisk && bNum >= 0 && bNum < MAX_NUM_BLOCKS;
+}
+
+static int ismetadata(uchar *block) {
+   return block[0] == SUPERBLOCK || block[0] == INODE;
+}
+
+int readCheckedBlock(int disknum, int bNum, uchar *block) {
+   uint32_t stored;
+   int error;
+
+   if(cacheable(disknum, bNum) && metacached[bNum]) {
+      memcpy(block, metablocks[bNum], BLOCKSIZE);
+      return 0;
+   }
+   if((error = readBlock(disknum, bNum, block)) != 0)
+      return error;
+
+   stored = load32(block + CHECKSUM_INDEX);
+   if(block[1] != MAGIC_NUM || stored != blockchecksum(block)) {
+      fprintf(stderr, "Block %d Failed Checksum\n", bNum);
+      return CORRUPT_FS;
+   }
+   if(cacheable(disknum, bNum) && ismetadata(block)) {
+      memcpy(metablocks[bNum], block, BLOCKSIZE);
+      metacached[bNum] = TRUE;
+   }
+   return 0;
+}
+
+int writeCheckedBlock(int disknum, int bNum, uchar *block) {
+   int error;
+
+   store32(block + CHECKSUM_INDEX, blockchecksum(block));
+   error = writeBlock(disknum, bNum, block);
+   // A block that may not have reached the disk is read back from it, and
+   // one reused for data leaves the cache
+   if(cacheable(disknum, bNum)) {
+      metacached[bNum] = !error && ismetadata(block);
+      if(metacached[bNum])
+         memcpy(metablocks[bNum], block, BLOCKSIZE);
+   }
+   return error;
+}
+
+/* Every block freed by a delete, truncate or rewrite comes through here, so
+   the slots of freed inodes are gone before the allocator can hand the blocks
+   out again. A reused block is also always written before it is read, and
+   writeCheckedBlock() replaces or drops its slot */
+int discardCheckedBlocks(int disknum, int bNum, int count) {
+   int loop;
+
+   for(loop = bNum; loop < bNum + count; loop++) {
+      if(cacheable(disknum, loop))
+         metacached[loop] = FALSE;
+   }
+   return discardBlocks(disknum, bNum, count);
+}
+
+int startMetaCache(int disknum) {
+   uchar root[BLOCKSIZE];
+   uchar block[BLOCKSIZE];
+   int error;
+   int loop;
+
+   stopMetaCache();
+   metadisk = disknum;
+   if((error = readCheckedBlock(disknum, SUPERBLOCK_ADDR, block)) != 0 ||
+      (error = readCheckedBlock(disknum, ROOT_ADDR, root)) != 0) {
+      stopMetaCache();
+      return error;
+   }
+   // An inode that can't be read isn't kept, and fails again when it's used
+   for(loop = ROOT_FIRST_ADDR; loop < CHECKSUM_INDEX; loop++) {
+      if(root[loop] != NULL_ADDR)
+         readCheckedBlock(disknum, root[loop], block);
+   }
+   return 0;
 }
 
+void stopMetaCache(void) {
+   metadisk = -1;
+   memset(metacached, FALSE, sizeof(metacached));
+}
@@ -17,10 +17,22 @@
 typedef unsigned char uchar;
 typedef struct tm tm;
 
+/* Returns the number of blocks of disk disknum the file system can address,
+    counting a partial last block and at most MAX_NUM_BLOCKS */
+int diskBlocks(int disknum);
+
 /* Checks FS on disk number disknum for integrity (proper superblock and root,
     magic number present on all blocks in second byte */
 int checkfs(int disknum);
 
+/* Does what checkfs does, then walks every file from the root, checking that
+    its inode and extents read back intact and are marked in use, and that no
+    block belongs to two files. Much slower than checkfs, it is meant for
+    recovery
+   Returns the number of blocks marked in use that no file or snapshot
+    reaches, which an interrupted update leaks, or CORRUPT_FS */
+int checkBlocks(int disknum);
+
 /* Returns address of the first free block after [skip] number of free
     blocks are skipped
       Ex. If skip is '1', return address of second free block
@@ -32,6 +44,40 @@ int nextFreeBlock(int disknum, int skip);
     index 0 is the first pointer in root */
 int nextRootAddrIndex(int disknum);
 int getInodeBlock(char *name, int disknum);
-void getBitmap(int disknum, uchar *bitmap);
+
+/* Same as getInodeBlock, but searches the root inode at address root, which
+    may be the root of a snapshot
+   Returns the error if the root or an inode can't be read */
+int findInodeBlock(char *name, int disknum, uchar root);
+
+/* Fills bitmap with the bitmap of blocks in use
+   Returns the error if the superblock can't be read, bitmap is then empty */
+int getBitmap(int disknum, uchar *bitmap);
+
+/* Fills held with the bitmap of blocks referenced by any snapshot, with the
+    same errors as getBitmap */
+int getHeldBitmap(int disknum, uchar *held);
+
+/* Reads block bNum and verifies its magic number and checksum
+   Returns CORRUPT_FS if either does not match, so damaged blocks are
+    caught the first time they are read instead of at mount */
+int readCheckedBlock(int disknum, int bNum, uchar *block);
+
+/* Stamps the checksum of block into its last 4 bytes and writes it to bNum */
+int writeCheckedBlock(int disknum, int bNum, uchar *block);
+
+/* Same as discardBlocks(), dropping the blocks from the metadata cache first */
+int discardCheckedBlocks(int disknum, int bNum, int count);
+
+/* Keeps the superblock, root and inode blocks of disk disknum in memory until
+    stopMetaCache(), loading the superblock, root and every inode the root lists
+    right away. readCheckedBlock() answers them from memory from then on.
+    writeCheckedBlock() still writes them straight through, in the order the
+    callers make them, since that order is what keeps a crash to leaked blocks.
+    Only metadata is kept, so data I/O never pushes it out, and a write that
+    fails drops its block so it is read back from the disk. One disk at a time
+   Returns the error reading the superblock or root, leaving the cache off */
+int startMetaCache(int disknum);
+void stopMetaCache(void);
 
 #endif
@@ -0,0 +1,81 @@
+#include "libTinyFS.h"
+#include "async.h"
+
+/* Three pool's worth, so submitting runs into QUEUE_FULL and has to wait for
+   spare requests more than once */
+#define ASYNC_REQUESTS (3 * ASYNC_QUEUE_SIZE + 17)
+#define ASYNC_FILE_SIZE (4 * DATA_SIZE)
+
+static char contents[ASYNC_FILE_SIZE];
+static char results[ASYNC_REQUESTS];
+static int calls[ASYNC_REQUESTS];
+static int wrong = 0;
+
+/* Each request reads the byte at its own offset, so a callback that gets
+   another request's result shows up too */
+static void done(void *arg, int result) {
+   long index = (long)arg;
+
+   calls[index]++;
+   if(result != 1 || results[index] != contents[index % ASYNC_FILE_SIZE])
+      wrong++;
+}
+
+/* Queues ASYNC_REQUESTS one byte reads of a file on a fresh disk, completing
+   whatever has finished whenever the pool runs out, and checks every
+   callback is called exactly once with the right byte. Returns 0 if they
+   all were */
+int main(int argc, char *argv[]) {
+   fileDescriptor FD;
+   long index;
+   long missed = 0;
+   long repeated = 0;
+   long waits = 0;
+   int result;
+   int i;
+
+   if(argc != 2) {
+      fprintf(stderr, "Usage: %s disk\n", argv[0]);
+      return 1;
+   }
+   for(i = 0; i < ASYNC_FILE_SIZE; i++)
+      contents[i] = (char)(i % 251 + 1);
+   if(tfs_mkfs(argv[1], DEFAULT_DISK_SIZE) < 0 || tfs_mount(argv[1]) < 0) {
+      fprintf(stderr, "Could not make \"%s\"\n", argv[1]);
+      return 1;
+   }
+   if((FD = tfs_openFile("async")) < 0 ||
+      tfs_writeFile(FD, contents, ASYNC_FILE_SIZE) < 0 ||
+      tfs_asyncStart() < 0) {
+      fprintf(stderr, "Could not set up \"%s\"\n", argv[1]);
+      tfs_unmount();
+      return 1;
+   }
+
+   for(index = 0; index < ASYNC_REQUESTS; index++) {
+      while((result = tfs_asyncRead(FD, results + index, 1,
+                                    index % ASYNC_FILE_SIZE, done,
+                                    (void *)index)) == QUEUE_FULL) {
+         tfs_asyncComplete(TRUE);
+         waits++;
+      }
+      if(result < 0) {
+         fprintf(stderr, "Queueing request %ld failed with %d\n", index, result);
+         break;
+      }
+   }
+   tfs_asyncStop();
+   tfs_closeFile(FD);
+   tfs_unmount();
+
+   for(index = 0; index < ASYNC_REQUESTS; index++) {
+      if(!calls[index])
+         missed++;
+      else if(calls[index] > 1)
+         repeated++;
+   }
+   printf("%d requests, %ld waits for a full queue\n", ASYNC_REQUESTS, waits);
+   printf("never called %ld, called twice %ld, wrong result %d\n", missed,
+          repeated, wrong);
+   return missed || repeated || wrong;
+}
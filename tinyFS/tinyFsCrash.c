@@ -0,0 +1,277 @@
+#include <unistd.h>
+#include <sys/wait.h>
+#include "libTinyFS.h"
+#include "diskDirect.h"
+#include "diskFault.h"
+#include "trace.h"
+
+#define CRASH_DISK_SIZE (MAX_NUM_BLOCKS * BLOCKSIZE)
+#define CRASH_FILES 8
+#define CRASH_ROUNDS 4
+#define CRASH_MAX_FILE (16 * DATA_SIZE)
+
+/* What a crash left behind, worst last */
+typedef enum outcome {
+   CRASH_OK,
+   CRASH_LEAKED,
+   CRASH_DAMAGED,
+   CRASH_UNREADABLE,
+   CRASH_CORRUPT,
+   CRASH_UNMOUNTABLE,
+   CRASH_NUM_OUTCOMES
+} outcome;
+
+static const char *outcomes[CRASH_NUM_OUTCOMES] = {
+   "intact", "leaked", "damaged", "unreadable", "corrupt", "unmountable"
+};
+
+/* Versions of each file the workload has written so far */
+static int versions[CRASH_FILES];
+static char buffer[CRASH_MAX_FILE];
+
+/* Byte at offset of version version of file file. Every byte says which
+   file it belongs to, so blocks of another file or garbage stand out */
+static char pattern(int file, int version, int offset) {
+   return (char)(file * 37 + version * 11 + offset % 251 + 1);
+}
+
+static void fill(int file, int size, int offset) {
+   int i;
+
+   versions[file]++;
+   for(i = 0; i < size; i++)
+      buffer[i] = pattern(file, versions[file], offset + i);
+}
+
+static void filename(char *name, int file) {
+   sprintf(name, "f%d", file);
+}
+
+/* Creates, rewrites, patches, truncates, deletes and defragments files on a
+   fresh image. Errors are expected once the disk crashes and are ignored */
+static void workload(char *disk) {
+   fileDescriptor fds[CRASH_FILES];
+   char name[MAX_NAME_SIZE];
+   int round;
+   int file;
+   int size;
+
+   memset(versions, 0, sizeof(versions));
+   if(tfs_mount(disk) < 0)
+      return;
+   for(round = 0; round < CRASH_ROUNDS; round++) {
+      for(file = 0; file < CRASH_FILES; file++) {
+         filename(name, file);
+         fds[file] = tfs_openFile(name);
+         size = (file * 3 + round * 5) % 16 * DATA_SIZE + file * 17;
+         fill(file, size, 0);
+         tfs_writeFile(fds[file], buffer, size);
+      }
+      for(file = round % 2; file < CRASH_FILES; file += 2) {
+         fill(file, DATA_SIZE, DATA_SIZE / 2);
+         tfs_writeAt(fds[file], buffer, DATA_SIZE, DATA_SIZE / 2);
+      }
+      tfs_truncate(fds[round], DATA_SIZE * 2 + round);
+      tfs_deleteFile(fds[CRASH_FILES - 1 - round]);
+      tfs_defrag(CRASH_FILES);
+      for(file = 0; file < CRASH_FILES; file++)
+         tfs_closeFile(fds[file]);
+   }
+   tfs_unmount();
+}
+
+/* Reads file back and checks every byte came from one of its versions, or is
+   a zero from a hole or an extension */
+static outcome checkfile(int file, tstat *stat) {
+   fileDescriptor FD;
+   char name[MAX_NAME_SIZE];
+   int offset;
+   int version;
+
+   filename(name, file);
+   FD = tfs_openFile(name);
+   if(FD < 0 || stat->size > CRASH_MAX_FILE ||
+      tfs_readAt(FD, buffer, stat->size, 0) != stat->size)
+      return CRASH_UNREADABLE;
+   tfs_closeFile(FD);
+   for(offset = 0; offset < stat->size; offset++) {
+      if(!buffer[offset])
+         continue;
+      for(version = 1; version <= versions[file]; version++) {
+         if(buffer[offset] == pattern(file, version, offset))
+            break;
+      }
+      if(version > versions[file])
+         return CRASH_DAMAGED;
+   }
+   return CRASH_OK;
+}
+
+/* Mounts what the crash left with the stdio backend, times the mount and
+   checkBlocks, and checks every file the workload made */
+static outcome recover(char *disk, uint64_t *mounttime, uint64_t *checktime,
+                       int *leaked) {
+   char name[MAX_NAME_SIZE];
+   tstat stat;
+   outcome worst = CRASH_OK;
+   outcome result;
+   int disknum;
+   int file;
+
+   *mounttime = traceClock();
+   disknum = tfs_mount(disk);
+   *mounttime = traceClock() - *mounttime;
+   *checktime = 0;
+   if(disknum < 0)
+      return CRASH_UNMOUNTABLE;
+
+   *checktime = traceClock();
+   *leaked = checkBlocks(disknum);
+   *checktime = traceClock() - *checktime;
+   if(*leaked < 0) {
+      tfs_unmount();
+      return CRASH_CORRUPT;
+   }
+   if(*leaked)
+      worst = CRASH_LEAKED;
+
+   for(file = 0; file < CRASH_FILES; file++) {
+      filename(name, file);
+      if(tfs_stat(name, &stat) != 0)
+         continue;
+      result = checkfile(file, &stat);
+      if(result > worst)
+         worst = result;
+   }
+   tfs_unmount();
+   return worst;
+}
+
+static int format(char *disk) {
+   setDiskBackend(NULL);
+   if(tfs_mkfs(disk, CRASH_DISK_SIZE) < 0)
+      return FALSE;
+   // The workload has to open the image again through the faulty backend
+   closeDisk(findFile(disk));
+   return TRUE;
+}
+
+/* Runs the workload through the faulty backend. When the plan exits at the
+   crash it runs in a child process, so whatever the backend below still
+   buffers dies with it */
+static void crashworkload(char *disk, faultplan *plan) {
+   pid_t child;
+
+   setFaultPlan(plan);
+   setDiskBackend(&faultDiskOps);
+   if(!plan->exitcrash) {
+      workload(disk);
+      return;
+   }
+   fflush(stdout);
+   child = fork();
+   if(child == 0) {
+      workload(disk);
+      _exit(0);
+   }
+   if(child > 0)
+      waitpid(child, NULL, 0);
+}
+
+/* Runs a workload on a fresh image once for every write it makes, cutting
+   the power right after that write, then mounts the image again and reports
+   what was left: whether it mounted, whether checkBlocks passed, how many
+   blocks leaked and whether files read back intact. Also reports the time
+   taken by the mount and by checkBlocks. -t tears the last write in half,
+   -e fails every Nth read and write as well, -d delays every block by
+   micros and -D runs the workload on the O_DIRECT backend, whose write-back
+   pool is lost at the crash, with physical blocks of -p bytes */
+int main(int argc, char *argv[]) {
+   faultplan plan = {0};
+   uint64_t mounttime;
+   uint64_t checktime;
+   uint64_t mounttotal = 0;
+   uint64_t checktotal = 0;
+   uint64_t mountmax = 0;
+   uint64_t checkmax = 0;
+   long counts[CRASH_NUM_OUTCOMES] = {0};
+   long total;
+   long leakedtotal = 0;
+   long crash;
+   int leaked;
+   int option;
+   int kind;
+   outcome result;
+
+   while((option = getopt(argc, argv, "te:d:Dp:")) != -1) {
+      switch(option) {
+      case 't':
+         plan.torn = TRUE;
+         break;
+      case 'e':
+         plan.readfail = plan.writefail = atoi(optarg);
+         break;
+      case 'd':
+         plan.readdelay = plan.writedelay = atoi(optarg);
+         break;
+      case 'D':
+         plan.below = &directDiskOps;
+         break;
+      case 'p':
+         if(setPhysBlockSize(atoi(optarg)) == 0)
+            break;
+         // fall through
+      default:
+         fprintf(stderr, "Usage: %s [-t] [-D [-p bytes]] [-e every] "
+                 "[-d micros] disk\n", argv[0]);
+         return 1;
+      }
+   }
+   if(optind != argc - 1) {
+      fprintf(stderr, "Usage: %s [-t] [-D [-p bytes]] [-e every] "
+              "[-d micros] disk\n", argv[0]);
+      return 1;
+   }
+
+   // A run without a crash tells how many writes there are to cut
+   if(!format(argv[optind])) {
+      fprintf(stderr, "Could not make \"%s\"\n", argv[optind]);
+      return 1;
+   }
+   setFaultPlan(&plan);
+   setDiskBackend(&faultDiskOps);
+   workload(argv[optind]);
+   total = faultWrites();
+
+   for(crash = 1; crash <= total; crash++) {
+      format(argv[optind]);
+      plan.crashafter = crash;
+      // Over stdio the writes after the crash are dropped instead, since
+      // the image is closed, and its buffer flushed, the same way either way
+      plan.exitcrash = plan.below != NULL;
+      crashworkload(argv[optind], &plan);
+
+      setDiskBackend(NULL);
+      leaked = 0;
+      result = recover(argv[optind], &mounttime, &checktime, &leaked);
+      counts[result]++;
+      if(result != CRASH_UNMOUNTABLE && result != CRASH_CORRUPT)
+         leakedtotal += leaked;
+      mounttotal += mounttime;
+      checktotal += checktime;
+      mountmax = mounttime > mountmax ? mounttime : mountmax;
+      checkmax = checktime > checkmax ? checktime : checkmax;
+   }
+
+   printf("%ld crash points\n", total);
+   for(kind = 0; kind < CRASH_NUM_OUTCOMES; kind++)
+      printf("%-12s %6ld\n", outcomes[kind], counts[kind]);
+   if(total) {
+      printf("leaked blocks %.2f per crash\n", (double)leakedtotal / total);
+      printf("mount         %.1f us mean, %.1f us max\n",
+             mounttotal / 1000.0 / total, mountmax / 1000.0);
+      printf("checkBlocks   %.1f us mean, %.1f us max\n",
+             checktotal / 1000.0 / total, checkmax / 1000.0);
+   }
+   return counts[CRASH_CORRUPT] + counts[CRASH_UNMOUNTABLE] != 0;
+}
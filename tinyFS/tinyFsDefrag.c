@@ -0,0 +1,38 @@
+#include "TinyFS.h"
+
+#define DEFAULT_BUDGET 16
+
+/* Defragments the TinyFS image named on the command line, moving at most
+   budget blocks at a time, and reports fragmentation before and after */
+int main(int argc, char *argv[]) {
+   int budget = DEFAULT_BUDGET;
+   int before;
+   int moved;
+   int total = 0;
+
+   if(argc < 2 || argc > 3) {
+      fprintf(stderr, "Usage: %s disk [budget]\n", argv[0]);
+      return 1;
+   }
+   if(argc == 3 && (budget = atoi(argv[2])) <= 0) {
+      fprintf(stderr, "Budget must be a positive number of blocks\n");
+      return 1;
+   }
+
+   if(tfs_mount(argv[1]) < 0) {
+      fprintf(stderr, "Could not mount \"%s\"\n", argv[1]);
+      return 1;
+   }
+
+   before = tfs_fragmentation();
+   while((moved = tfs_defrag(budget)) > 0)
+      total += moved;
+   if(moved < 0)
+      fprintf(stderr, "Defragmentation stopped with error %d\n", moved);
+
+   printf("Fragmentation: %d%% before, %d%% after (%d blocks moved)\n",
+          before, tfs_fragmentation(), total);
+
+   tfs_unmount();
+   return moved < 0;
+}
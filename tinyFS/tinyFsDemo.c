@@ -10,11 +10,9 @@ static void output(char *str) {
 
 int main() {
    int status = -5;
-   uchar buff[5] = "test";
-   uchar buff2[6] = "test2";
    uchar buff3[DATA_SIZE * 2 + 1];
-   uchar contents[1] = {0x42};
-   fileDescriptor fd1, fd2;
+   fileDescriptor fd1, fd2, fd3;
+   tstatfs before, after;
    char mybuffer = 0;
    char value1 = 0x67;
    char value2 = 0x42;
@@ -132,6 +130,21 @@ int main() {
    output("Let's check the timestamps again");
    tfs_readFileInfo(fd2);
 
+   output("Names longer than 8 characters are cut short. Let's close such a file and reopen it by the same name");
+   puts(">Writing, closing and reopening file \"longname1\"");
+   fd3 = tfs_openFile("longname1");
+   status = tfs_writeFile(fd3, (char *)buff3, 1);
+   tfs_closeFile(fd3);
+   tfs_statfs(&before);
+   fd3 = tfs_openFile("longname1");
+   tfs_statfs(&after);
+   if(!status && fd3 >= 0 && !tfs_readByte(fd3, &mybuffer) && mybuffer == value2 &&
+      before.files == after.files)
+      printf("   Successfully reopened the same file, still %d files\n\n", after.files);
+   else
+      puts("   Failed!\n");
+   tfs_closeFile(fd3);
+
    output("Let's unmount the current disk");
    puts(">unmounting disk \"disk0.disk\"");
    status = tfs_unmount();
@@ -0,0 +1,680 @@
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include "TinyFS.h"
+
+/* Seconds the kernel may cache names and attributes without asking again.
+   Every change goes through this process, so the caches only go stale if the
+   image is changed behind the mount */
+#define DEFAULT_TIMEOUT 1.0
+/* Largest write the kernel is asked to send at once */
+#define MAX_WRITE (1 << 20)
+
+/* The library keeps one mounted disk and one file table for the whole
+   process, so requests are dispatched on many threads but run one at a time */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Open handles per file descriptor. Opening a file twice returns the same
+   descriptor, which is closed when its last handle is released */
+static int handles[MAX_NUM_FILES];
+/* Bumped when a file is deleted under its handles. A handle carries the
+   generation of its descriptor next to it, so handles of a deleted file can't
+   reach whatever file gets the descriptor next */
+static unsigned int generation[MAX_NUM_FILES];
+
+struct options {
+   double timeout;
+};
+
+static struct options options = {DEFAULT_TIMEOUT};
+
+static const struct fuse_opt optionspec[] = {
+   {"timeout=%lf", offsetof(struct options, timeout), 0},
+   FUSE_OPT_END
+};
+
+static int toerrno(int error) {
+   switch(error) {
+   case FILE_NOT_FOUND:
+      return ENOENT;
+   case ROOT_DIRECTORY_FULL:
+      return ENOSPC;
+   case READ_ONLY_FS:
+      return EROFS;
+   case FILE_TOO_LARGE:
+      return EFBIG;
+   case QUOTA_EXCEEDED:
+      return EDQUOT;
+   default:
+      return EIO;
+   }
+}
+
+/* Inode numbers are the blocks holding the inodes, so the root directory at
+   ROOT_ADDR is FUSE_ROOT_ID and every file keeps its number while it exists */
+static void fillattr(tstat *stat, struct stat *attr) {
+   memset(attr, 0, sizeof(struct stat));
+   attr->st_ino = stat->inode;
+   attr->st_mode = S_IFREG | 0644;
+   attr->st_nlink = 1;
+   attr->st_uid = getuid();
+   attr->st_gid = getgid();
+   attr->st_size = stat->size;
+   attr->st_blksize = BLOCKSIZE;
+   attr->st_blocks = (stat->blocks + 1) * BLOCKSIZE / 512;
+   attr->st_atime = stat->accessed;
+   attr->st_mtime = stat->modified;
+   attr->st_ctime = stat->modified;
+}
+
+static void rootattr(struct stat *attr) {
+   memset(attr, 0, sizeof(struct stat));
+   attr->st_ino = FUSE_ROOT_ID;
+   attr->st_mode = S_IFDIR | 0755;
+   attr->st_nlink = 2;
+   attr->st_uid = getuid();
+   attr->st_gid = getgid();
+}
+
+static int validname(fuse_req_t req, fuse_ino_t parent, const char *name) {
+   if(parent != FUSE_ROOT_ID) {
+      fuse_reply_err(req, ENOTDIR);
+      return FALSE;
+   }
+   if(strlen(name) > MAX_NAME_SIZE) {
+      fuse_reply_err(req, ENAMETOOLONG);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+static void fillentry(tstat *stat, struct fuse_entry_param *entry) {
+   memset(entry, 0, sizeof(struct fuse_entry_param));
+   entry->ino = stat->inode;
+   // A deleted inode block can come back as another file
+   entry->generation = stat->created;
+   entry->attr_timeout = options.timeout;
+   entry->entry_timeout = options.timeout;
+   fillattr(stat, &entry->attr);
+}
+
+/* Opens file name and counts one more handle on its descriptor. Returns the
+   handle in fh */
+static int openhandle(char *name, uint64_t *fh) {
+   fileDescriptor FD = tfs_openFile(name);
+
+   if(FD < 0)
+      return FD;
+   handles[FD]++;
+   *fh = (uint64_t)generation[FD] << 32 | FD;
+   return 0;
+}
+
+/* Returns the descriptor of handle fh, or -1 if its file was deleted */
+static fileDescriptor handlefd(uint64_t fh) {
+   fileDescriptor FD = fh & 0xFFFFFFFF;
+
+   return fh >> 32 == generation[FD] ? FD : -1;
+}
+
+static void closehandle(uint64_t fh) {
+   fileDescriptor FD = handlefd(fh);
+
+   if(FD >= 0 && handles[FD] > 0 && --handles[FD] == 0)
+      tfs_closeFile(FD);
+}
+
+/* Runs op on existing file name through the descriptor of an open handle if
+   there is one, or through a descriptor opened just for op */
+static int withfile(char *name, int (*op)(fileDescriptor, void *), void *arg) {
+   fileDescriptor FD = tfs_openFile(name);
+   int error;
+
+   if(FD < 0)
+      return FD;
+   error = op(FD, arg);
+   if(!handles[FD])
+      tfs_closeFile(FD);
+   return error;
+}
+
+/* Deleting a file releases its descriptor, so handles still open on it fail
+   from then on instead of reading the file until they are closed */
+static int deleteop(fileDescriptor FD, void *arg) {
+   (void)arg;
+   handles[FD] = 0;
+   generation[FD]++;
+   return tfs_deleteFile(FD);
+}
+
+static int renameop(fileDescriptor FD, void *arg) {
+   return tfs_rename(FD, arg);
+}
+
+static int truncateop(fileDescriptor FD, void *arg) {
+   return tfs_truncate(FD, *(off_t *)arg);
+}
+
+/* Arguments of the extended attribute calls run through withfile */
+typedef struct xattrargs {
+   char *name;
+   char *value;
+   int size;
+} xattrargs;
+
+static int setxattrop(fileDescriptor FD, void *arg) {
+   xattrargs *args = arg;
+
+   return tfs_setxattr(FD, args->name, args->value, args->size);
+}
+
+static int getxattrop(fileDescriptor FD, void *arg) {
+   xattrargs *args = arg;
+
+   return tfs_getxattr(FD, args->name, args->value, args->size);
+}
+
+static int listxattrop(fileDescriptor FD, void *arg) {
+   xattrargs *args = arg;
+
+   return tfs_listxattr(FD, args->value, args->size);
+}
+
+static int removexattrop(fileDescriptor FD, void *arg) {
+   return tfs_removexattr(FD, ((xattrargs *)arg)->name);
+}
+
+/* Runs an extended attribute call on file ino. A missing attribute is
+   ENODATA and one that doesn't fit is ERANGE, as xattr(7) has it */
+static int xattrcall(fuse_ino_t ino, int (*op)(fileDescriptor, void *),
+                     xattrargs *args) {
+   tstat stat;
+   int result;
+
+   if(ino == FUSE_ROOT_ID)
+      return -ENOTSUP;
+   pthread_mutex_lock(&lock);
+   result = tfs_statInode(ino, &stat);
+   if(!result)
+      result = withfile(stat.name, op, args);
+   pthread_mutex_unlock(&lock);
+   if(result == FILE_NOT_FOUND)
+      return -ENODATA;
+   if(result == FILE_TOO_LARGE)
+      return op == setxattrop ? -E2BIG : -ERANGE;
+   return result < 0 ? -toerrno(result) : result;
+}
+
+static void tfslookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+   struct fuse_entry_param entry;
+   tstat stat;
+   int error;
+
+   if(!validname(req, parent, name))
+      return;
+   pthread_mutex_lock(&lock);
+   error = tfs_stat((char *)name, &stat);
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   fillentry(&stat, &entry);
+   fuse_reply_entry(req, &entry);
+}
+
+static void tfsgetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+   struct stat attr;
+   tstat stat;
+   int error;
+
+   (void)fi;
+   if(ino == FUSE_ROOT_ID) {
+      rootattr(&attr);
+      fuse_reply_attr(req, &attr, options.timeout);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   error = tfs_statInode(ino, &stat);
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   fillattr(&stat, &attr);
+   fuse_reply_attr(req, &attr, options.timeout);
+}
+
+/* Only size changes are stored, the other attributes are fixed */
+static void tfssetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int set, struct fuse_file_info *fi) {
+   struct stat reply;
+   tstat stat;
+   off_t size = attr->st_size;
+   int error;
+
+   if(ino == FUSE_ROOT_ID) {
+      rootattr(&reply);
+      fuse_reply_attr(req, &reply, options.timeout);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   error = tfs_statInode(ino, &stat);
+   if(!error && (set & FUSE_SET_ATTR_SIZE)) {
+      if(size > (off_t)MAX_FILE_BLOCKS * DATA_SIZE)
+         error = FILE_TOO_LARGE;
+      else if(fi && handlefd(fi->fh) >= 0)
+         error = tfs_truncate(handlefd(fi->fh), size);
+      else
+         error = withfile(stat.name, truncateop, &size);
+      if(!error)
+         error = tfs_statInode(ino, &stat);
+   }
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   fillattr(&stat, &reply);
+   fuse_reply_attr(req, &reply, options.timeout);
+}
+
+static void tfsopen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+   tstat stat;
+   int error;
+
+   pthread_mutex_lock(&lock);
+   error = tfs_statInode(ino, &stat);
+   if(!error)
+      error = openhandle(stat.name, &fi->fh);
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   // Nothing changes the file except this mount, so cached pages stay good
+   fi->keep_cache = 1;
+   fuse_reply_open(req, fi);
+}
+
+static void tfscreate(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi) {
+   struct fuse_entry_param entry;
+   tstat stat;
+   int error;
+
+   (void)mode;
+   if(!validname(req, parent, name))
+      return;
+   pthread_mutex_lock(&lock);
+   error = openhandle((char *)name, &fi->fh);
+   if(!error)
+      error = tfs_stat((char *)name, &stat);
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   fi->keep_cache = 1;
+   fillentry(&stat, &entry);
+   fuse_reply_create(req, &entry, fi);
+}
+
+static void tfsrelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+   (void)ino;
+   pthread_mutex_lock(&lock);
+   closehandle(fi->fh);
+   pthread_mutex_unlock(&lock);
+   fuse_reply_err(req, 0);
+}
+
+static void tfsread(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+   char *buffer = malloc(size);
+   int count;
+
+   (void)ino;
+   if(!buffer) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   count = off > MAX_FILE_BLOCKS * DATA_SIZE ? 0 :
+           tfs_readAt(handlefd(fi->fh), buffer, size, off);
+   pthread_mutex_unlock(&lock);
+   if(count < 0)
+      fuse_reply_err(req, toerrno(count));
+   else
+      fuse_reply_buf(req, buffer, count);
+   free(buffer);
+}
+
+static void tfswrite(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi) {
+   int count;
+
+   (void)ino;
+   if(off + size > (size_t)MAX_FILE_BLOCKS * DATA_SIZE) {
+      fuse_reply_err(req, EFBIG);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   count = tfs_writeAt(handlefd(fi->fh), (char *)buf, size, off);
+   pthread_mutex_unlock(&lock);
+   if(count < 0)
+      fuse_reply_err(req, toerrno(count));
+   else
+      fuse_reply_write(req, count);
+}
+
+static void tfsunlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+   tstat stat;
+   int error;
+
+   if(!validname(req, parent, name))
+      return;
+   pthread_mutex_lock(&lock);
+   error = tfs_stat((char *)name, &stat);
+   if(!error)
+      error = withfile(stat.name, deleteop, NULL);
+   pthread_mutex_unlock(&lock);
+   fuse_reply_err(req, error ? toerrno(error) : 0);
+}
+
+static void tfsrename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname,
+                      unsigned int flags) {
+   tstat stat;
+   tstat target;
+   int error;
+
+   if(!validname(req, parent, name) || !validname(req, newparent, newname))
+      return;
+   if(flags & ~RENAME_NOREPLACE) {
+      fuse_reply_err(req, EINVAL);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   error = tfs_stat((char *)name, &stat);
+   if(!error && tfs_stat((char *)newname, &target) == 0 &&
+      target.inode != stat.inode) {
+      // Renaming over a file replaces it
+      if(flags & RENAME_NOREPLACE)
+         error = -EEXIST;
+      else
+         error = withfile(target.name, deleteop, NULL);
+   }
+   if(!error)
+      error = withfile(stat.name, renameop, (void *)newname);
+   pthread_mutex_unlock(&lock);
+   if(error == -EEXIST)
+      fuse_reply_err(req, EEXIST);
+   else
+      fuse_reply_err(req, error ? toerrno(error) : 0);
+}
+
+/* Lists ".", ".." and then every file; off is the index of the next entry */
+static void tfsreaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi) {
+   tstat stats[MAX_NUM_FILES];
+   struct stat attr;
+   tdir dir;
+   char *buffer;
+   size_t used = 0;
+   size_t entry;
+   int count;
+   int next;
+
+   (void)fi;
+   if(ino != FUSE_ROOT_ID) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+   }
+   buffer = malloc(size);
+   if(!buffer) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   count = tfs_openDir(&dir);
+   if(count == 0)
+      count = tfs_readDirEntries(&dir, stats, MAX_NUM_FILES);
+   pthread_mutex_unlock(&lock);
+   if(count < 0) {
+      free(buffer);
+      fuse_reply_err(req, toerrno(count));
+      return;
+   }
+
+   for(next = off; next < count + 2; next++) {
+      if(next < 2) {
+         rootattr(&attr);
+         entry = fuse_add_direntry(req, buffer + used, size - used,
+                                   next ? ".." : ".", &attr, next + 1);
+      }
+      else {
+         fillattr(&stats[next - 2], &attr);
+         entry = fuse_add_direntry(req, buffer + used, size - used,
+                                   stats[next - 2].name, &attr, next + 1);
+      }
+      if(entry > size - used)
+         break;
+      used += entry;
+   }
+   fuse_reply_buf(req, buffer, used);
+   free(buffer);
+}
+
+static void tfssetxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags) {
+   char probe;
+   xattrargs args = {(char *)name, (char *)value, size};
+   xattrargs exists = {(char *)name, &probe, 0};
+   int result = 0;
+
+   if(size > MAX_XATTR_VALUE_SIZE) {
+      fuse_reply_err(req, E2BIG);
+      return;
+   }
+   if(strlen(name) > MAX_XATTR_NAME_SIZE) {
+      fuse_reply_err(req, ERANGE);
+      return;
+   }
+   if(flags & (XATTR_CREATE | XATTR_REPLACE)) {
+      result = xattrcall(ino, getxattrop, &exists);
+      if(result >= 0 && (flags & XATTR_CREATE))
+         result = -EEXIST;
+      else if(result == -ENODATA && !(flags & XATTR_REPLACE))
+         result = 0;
+   }
+   if(result >= 0)
+      result = xattrcall(ino, setxattrop, &args);
+   fuse_reply_err(req, result < 0 ? -result : 0);
+}
+
+static void tfsgetxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        size_t size) {
+   char value[MAX_XATTR_VALUE_SIZE];
+   xattrargs args = {(char *)name, value, size < sizeof(value) ? size : sizeof(value)};
+   int result;
+
+   if(strlen(name) > MAX_XATTR_NAME_SIZE) {
+      fuse_reply_err(req, ENODATA);
+      return;
+   }
+   result = xattrcall(ino, getxattrop, &args);
+   if(result < 0)
+      fuse_reply_err(req, -result);
+   else if(!size)
+      fuse_reply_xattr(req, result);
+   else
+      fuse_reply_buf(req, value, result);
+}
+
+static void tfslistxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+   char *list = NULL;
+   xattrargs args = {NULL, NULL, 0};
+   int result;
+
+   // Sized by asking first, since a full list can be long
+   if(size) {
+      result = xattrcall(ino, listxattrop, &args);
+      if(result > (int)size)
+         result = -ERANGE;
+      if(result >= 0 && !(list = malloc(result + 1)))
+         result = -ENOMEM;
+      args.value = list;
+      args.size = result + 1;
+      if(result > 0)
+         result = xattrcall(ino, listxattrop, &args);
+   }
+   else
+      result = xattrcall(ino, listxattrop, &args);
+   if(result < 0)
+      fuse_reply_err(req, -result);
+   else if(!size)
+      fuse_reply_xattr(req, result);
+   else
+      fuse_reply_buf(req, list, result);
+   free(list);
+}
+
+static void tfsremovexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+   xattrargs args = {(char *)name, NULL, 0};
+   int result = xattrcall(ino, removexattrop, &args);
+
+   fuse_reply_err(req, result < 0 ? -result : 0);
+}
+
+/* Answered from the counters the library keeps, without touching the image.
+   A root quota lowers the total to what files may use */
+static void tfsstatfs(fuse_req_t req, fuse_ino_t ino) {
+   struct statvfs info;
+   tstatfs stat;
+   int error;
+
+   (void)ino;
+   pthread_mutex_lock(&lock);
+   error = tfs_statfs(&stat);
+   pthread_mutex_unlock(&lock);
+   if(error) {
+      fuse_reply_err(req, toerrno(error));
+      return;
+   }
+   if(stat.quota && stat.quota < stat.blocks - 2) {
+      stat.free -= stat.blocks - 2 - stat.quota;
+      stat.free = stat.free > 0 ? stat.free : 0;
+      stat.blocks = stat.quota + 2;
+   }
+   memset(&info, 0, sizeof(struct statvfs));
+   info.f_bsize = info.f_frsize = BLOCKSIZE;
+   info.f_blocks = stat.blocks;
+   info.f_bfree = info.f_bavail = stat.free;
+   info.f_files = stat.files + stat.freefiles;
+   info.f_ffree = info.f_favail = stat.freefiles;
+   info.f_namemax = MAX_NAME_SIZE;
+   fuse_reply_statfs(req, &info);
+}
+
+static void tfsinit(void *userdata, struct fuse_conn_info *conn) {
+   (void)userdata;
+   if(conn->max_write > MAX_WRITE || !conn->max_write)
+      conn->max_write = MAX_WRITE;
+   conn->max_readahead = MAX_FILE_BLOCKS * DATA_SIZE;
+   if(conn->capable & FUSE_CAP_ASYNC_READ)
+      conn->want |= FUSE_CAP_ASYNC_READ;
+}
+
+static void tfsdestroy(void *userdata) {
+   (void)userdata;
+   pthread_mutex_lock(&lock);
+   tfs_unmount();
+   pthread_mutex_unlock(&lock);
+}
+
+static const struct fuse_lowlevel_ops ops = {
+   .init = tfsinit,
+   .destroy = tfsdestroy,
+   .lookup = tfslookup,
+   .getattr = tfsgetattr,
+   .setattr = tfssetattr,
+   .open = tfsopen,
+   .create = tfscreate,
+   .release = tfsrelease,
+   .read = tfsread,
+   .write = tfswrite,
+   .unlink = tfsunlink,
+   .rename = tfsrename,
+   .readdir = tfsreaddir,
+   .statfs = tfsstatfs,
+   .setxattr = tfssetxattr,
+   .getxattr = tfsgetxattr,
+   .listxattr = tfslistxattr,
+   .removexattr = tfsremovexattr,
+};
+
+/* Mounts the TinyFS image named on the command line at a directory. Requests
+   from the kernel are served on several threads unless -s is given */
+int main(int argc, char *argv[]) {
+   struct fuse_args args;
+   struct fuse_cmdline_opts opts;
+   struct fuse_loop_config config;
+   struct fuse_session *se;
+   char *image;
+   int ret = 1;
+
+   if(argc < 3) {
+      fprintf(stderr, "Usage: %s disk mountpoint [-s] [-f] [-o timeout=secs]\n",
+              argv[0]);
+      return 1;
+   }
+   // The image comes first, fuse parses everything after it
+   image = argv[1];
+   argv[1] = argv[0];
+   args = (struct fuse_args)FUSE_ARGS_INIT(argc - 1, argv + 1);
+
+   if(fuse_parse_cmdline(&args, &opts) != 0)
+      return 1;
+   if(fuse_opt_parse(&args, &options, optionspec, NULL) != 0)
+      goto out;
+   if(!opts.mountpoint) {
+      fprintf(stderr, "No mountpoint given\n");
+      goto out;
+   }
+   if(tfs_mount(image) < 0) {
+      fprintf(stderr, "Could not mount \"%s\"\n", image);
+      goto out;
+   }
+
+   se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+   if(!se) {
+      tfs_unmount();
+      goto out;
+   }
+   if(fuse_set_signal_handlers(se) == 0) {
+      if(fuse_session_mount(se, opts.mountpoint) == 0) {
+         fuse_daemonize(opts.foreground);
+         if(opts.singlethread)
+            ret = fuse_session_loop(se);
+         else {
+            config.clone_fd = opts.clone_fd;
+            config.max_idle_threads = opts.max_idle_threads;
+            ret = fuse_session_loop_mt(se, &config);
+         }
+         fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+   }
+   fuse_session_destroy(se);
+
+out:
+   free(opts.mountpoint);
+   fuse_opt_free_args(&args);
+   return ret ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "TinyFS.h"
+
+/* Packs the regular files of a directory into a new TinyFS image. Names
+   longer than a TinyFS name are skipped, and the image is made just large
+   enough unless a size is given */
+int main(int argc, char *argv[]) {
+   char *names[MAX_NUM_FILES];
+   char *buffers[MAX_NUM_FILES];
+   int sizes[MAX_NUM_FILES];
+   char path[PATH_MAX];
+   struct dirent *entry;
+   struct stat info;
+   FILE *file;
+   DIR *dir;
+   int nBytes = 0;
+   int count = 0;
+   int error;
+
+   if(argc < 3 || argc > 4) {
+      fprintf(stderr, "Usage: %s directory disk [bytes]\n", argv[0]);
+      return 1;
+   }
+   if(argc == 4 && (nBytes = atoi(argv[3])) <= 0) {
+      fprintf(stderr, "Size must be a positive number of bytes\n");
+      return 1;
+   }
+   dir = opendir(argv[1]);
+   if(!dir) {
+      fprintf(stderr, "Could not open \"%s\"\n", argv[1]);
+      return 1;
+   }
+
+   while((entry = readdir(dir))) {
+      snprintf(path, sizeof(path), "%s/%s", argv[1], entry->d_name);
+      if(stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+         continue;
+      if(strlen(entry->d_name) > MAX_NAME_SIZE) {
+         fprintf(stderr, "Skipping \"%s\", name is too long\n", entry->d_name);
+         continue;
+      }
+      if(info.st_size > MAX_FILE_BLOCKS * DATA_SIZE) {
+         fprintf(stderr, "Skipping \"%s\", file is too large\n", entry->d_name);
+         continue;
+      }
+      if(count == MAX_NUM_FILES) {
+         fprintf(stderr, "Only the first %d files fit\n", MAX_NUM_FILES);
+         break;
+      }
+
+      names[count] = strdup(entry->d_name);
+      sizes[count] = info.st_size;
+      buffers[count] = malloc(info.st_size + 1);
+      file = fopen(path, "rb");
+      if(!names[count] || !buffers[count] || !file ||
+         fread(buffers[count], 1, sizes[count], file) != (size_t)sizes[count]) {
+         fprintf(stderr, "Could not read \"%s\"\n", path);
+         return 1;
+      }
+      fclose(file);
+      count++;
+   }
+   closedir(dir);
+
+   error = tfs_pack(argv[2], nBytes, names, buffers, sizes, count);
+   if(error == ROOT_DIRECTORY_FULL)
+      fprintf(stderr, "The files don't fit on the disk\n");
+   else if(error)
+      fprintf(stderr, "Could not write \"%s\" (error %d)\n", argv[2], error);
+   else
+      printf("Packed %d files into \"%s\"\n", count, argv[2]);
+
+   while(count-- > 0) {
+      free(names[count]);
+      free(buffers[count]);
+   }
+   return error != 0;
+}
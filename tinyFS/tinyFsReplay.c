@@ -0,0 +1,229 @@
+#include <unistd.h>
+#include "trace.h"
+
+/* Largest buffer any traced call can use */
+#define MAX_TRACE_BUFFER (MAX_FILE_BLOCKS * DATA_SIZE)
+
+/* Everything the replay measured for one kind of call */
+typedef struct opstats {
+   uint64_t *latencies;
+   long count;
+   long allocated;
+   uint64_t recorded;
+   long reads;
+   long writes;
+   long mismatched;
+} opstats;
+
+static opstats ops[TRACE_NUM_OPS];
+static fileDescriptor fdmap[MAX_NUM_FILES];
+static char buffer[MAX_TRACE_BUFFER];
+
+static int addlatency(opstats *op, uint64_t latency) {
+   uint64_t *grown;
+
+   if(op->count == op->allocated) {
+      op->allocated = op->allocated ? 2 * op->allocated : 64;
+      grown = realloc(op->latencies, op->allocated * sizeof(uint64_t));
+      if(!grown)
+         return FALSE;
+      op->latencies = grown;
+   }
+   op->latencies[op->count++] = latency;
+   return TRUE;
+}
+
+static int compare(const void *a, const void *b) {
+   uint64_t left = *(const uint64_t *)a;
+   uint64_t right = *(const uint64_t *)b;
+
+   return left < right ? -1 : left > right;
+}
+
+/* Returns the descriptor the replay got for descriptor fd of the trace */
+static fileDescriptor livefd(int fd) {
+   return fd >= 0 && fd < MAX_NUM_FILES ? fdmap[fd] : -1;
+}
+
+/* Runs the call of record against disk and returns its result */
+static int replay(tracerecord *record, char *disk) {
+   tstat stat;
+   fileDescriptor FD = livefd(record->fd);
+   int size = record->size;
+   int result;
+
+   if(size < 0 || size > MAX_TRACE_BUFFER)
+      size = MAX_TRACE_BUFFER;
+   switch(record->op) {
+   case TRACE_MKFS:
+      return tfs_mkfs(disk, record->size);
+   case TRACE_MOUNT:
+      return tfs_mount(disk);
+   case TRACE_MOUNT_READ_ONLY:
+      return tfs_mountReadOnly(disk);
+   case TRACE_UNMOUNT:
+      return tfs_unmount();
+   case TRACE_OPEN:
+      result = tfs_openFile(record->name);
+      if(record->result >= 0 && record->result < MAX_NUM_FILES)
+         fdmap[record->result] = result;
+      return result;
+   case TRACE_CLOSE:
+      return tfs_closeFile(FD);
+   case TRACE_WRITE:
+      return tfs_writeFile(FD, buffer, size);
+   case TRACE_WRITE_AT:
+      return tfs_writeAt(FD, buffer, size, record->offset);
+   case TRACE_READ_AT:
+      return tfs_readAt(FD, buffer, size, record->offset);
+   case TRACE_READ_BYTE:
+      return tfs_readByte(FD, buffer);
+   case TRACE_SEEK:
+      return tfs_seek(FD, record->offset);
+   case TRACE_TRUNCATE:
+      return tfs_truncate(FD, record->size);
+   case TRACE_FALLOCATE:
+      return tfs_fallocate(FD, record->offset, record->size);
+   case TRACE_DELETE:
+      return tfs_deleteFile(FD);
+   case TRACE_RENAME:
+      return tfs_rename(FD, record->name);
+   case TRACE_STAT:
+      return tfs_stat(record->name, &stat);
+   case TRACE_WRITE_BEGIN:
+      return tfs_writeBegin(FD);
+   case TRACE_WRITE_CHUNK:
+      return tfs_writeChunk(FD, buffer, size);
+   case TRACE_WRITE_COMMIT:
+      return tfs_writeCommit(FD);
+   case TRACE_WRITE_ABORT:
+      return tfs_writeAbort(FD);
+   default:
+      return READ_ERROR;
+   }
+}
+
+/* Waits until the call that started at start nanoseconds into the trace is
+   due, counting from began */
+static void waitfor(uint64_t start, uint64_t began) {
+   uint64_t now = traceClock() - began;
+   struct timespec pause;
+
+   if(start <= now)
+      return;
+   pause.tv_sec = (start - now) / 1000000000;
+   pause.tv_nsec = (start - now) % 1000000000;
+   nanosleep(&pause, NULL);
+}
+
+static void report(void) {
+   uint64_t total;
+   opstats *op;
+   long i;
+   int kind;
+
+   printf("%-10s %7s %9s %9s %9s %9s %9s %8s %8s %5s\n", "call", "count",
+          "mean us", "p50 us", "p99 us", "max us", "was us", "reads", "writes",
+          "diff");
+   for(kind = 1; kind < TRACE_NUM_OPS; kind++) {
+      op = &ops[kind];
+      if(!op->count)
+         continue;
+      qsort(op->latencies, op->count, sizeof(uint64_t), compare);
+      for(i = 0, total = 0; i < op->count; i++)
+         total += op->latencies[i];
+      printf("%-10s %7ld %9.1f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f %5ld\n",
+             traceOpName(kind), op->count, total / 1000.0 / op->count,
+             op->latencies[op->count / 2] / 1000.0,
+             op->latencies[op->count * 99 / 100] / 1000.0,
+             op->latencies[op->count - 1] / 1000.0,
+             op->recorded / 1000.0 / op->count,
+             (double)op->reads / op->count, (double)op->writes / op->count,
+             op->mismatched);
+   }
+}
+
+/* Replays a trace against a fresh image and reports the latency of every
+   kind of call, the blocks it read and wrote per call, and how many calls
+   returned something other than what was recorded. Calls run back to back,
+   or at their recorded times with -t. Buffers are filled with a fixed
+   pattern, since traces keep only their sizes */
+int main(int argc, char *argv[]) {
+   tracerecord record;
+   diskstats before;
+   diskstats after;
+   uint64_t began;
+   uint64_t latency;
+   opstats *op;
+   FILE *trace;
+   int timed = FALSE;
+   int bytes = MAX_DISK_SIZE;
+   int result;
+   int first = TRUE;
+   int i;
+
+   if(argc > 1 && !strcmp(argv[1], "-t")) {
+      timed = TRUE;
+      argv++;
+      argc--;
+   }
+   if(argc < 3 || argc > 4) {
+      fprintf(stderr, "Usage: %s [-t] trace disk [bytes]\n", argv[0]);
+      return 1;
+   }
+   if(argc == 4 && (bytes = atoi(argv[3])) <= 0) {
+      fprintf(stderr, "Size must be a positive number of bytes\n");
+      return 1;
+   }
+   trace = traceOpen(argv[1]);
+   if(!trace) {
+      fprintf(stderr, "\"%s\" is not a trace\n", argv[1]);
+      return 1;
+   }
+
+   for(i = 0; i < MAX_TRACE_BUFFER; i++)
+      buffer[i] = 'a' + i % 26;
+   for(i = 0; i < MAX_NUM_FILES; i++)
+      fdmap[i] = -1;
+   if(tfs_mkfs(argv[2], bytes) < 0) {
+      fprintf(stderr, "Could not make \"%s\"\n", argv[2]);
+      return 1;
+   }
+
+   began = traceClock();
+   while(traceNext(trace, &record)) {
+      // A trace started on a mounted disk gets the fresh image mounted
+      if(first && record.op != TRACE_MKFS && record.op != TRACE_MOUNT &&
+         record.op != TRACE_MOUNT_READ_ONLY)
+         tfs_mount(argv[2]);
+      first = FALSE;
+      if(timed)
+         waitfor(record.start, began);
+
+      getDiskStats(&before);
+      latency = traceClock();
+      result = replay(&record, argv[2]);
+      latency = traceClock() - latency;
+      getDiskStats(&after);
+
+      op = &ops[record.op];
+      if(!addlatency(op, latency)) {
+         fprintf(stderr, "Out of memory\n");
+         return 1;
+      }
+      op->recorded += record.latency;
+      op->reads += after.reads - before.reads;
+      op->writes += after.writes - before.writes;
+      // Descriptors and disks may be numbered differently, only whether
+      // they were opened counts
+      if(record.op == TRACE_OPEN || record.op == TRACE_MOUNT ||
+         record.op == TRACE_MOUNT_READ_ONLY ?
+         (result < 0) != (record.result < 0) : result != record.result)
+         op->mismatched++;
+   }
+   fclose(trace);
+   tfs_unmount();
+
+   report();
+   return 0;
+}
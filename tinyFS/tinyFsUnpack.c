@@ -0,0 +1,61 @@
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "TinyFS.h"
+
+/* Copies every file of a TinyFS image into a directory, creating it if
+   needed. Each file is read whole with one tfs_readAt, which walks its chain
+   once and reads its blocks in order */
+int main(int argc, char *argv[]) {
+   tstat stats[MAX_NUM_FILES];
+   char path[PATH_MAX];
+   char *buffer;
+   tdir dir;
+   FILE *file;
+   fileDescriptor FD;
+   int count;
+   int read;
+   int failed = 0;
+   int i;
+
+   if(argc != 3) {
+      fprintf(stderr, "Usage: %s disk directory\n", argv[0]);
+      return 1;
+   }
+   if(mkdir(argv[2], 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Could not create \"%s\"\n", argv[2]);
+      return 1;
+   }
+   if(tfs_mount(argv[1]) < 0) {
+      fprintf(stderr, "Could not mount \"%s\"\n", argv[1]);
+      return 1;
+   }
+
+   count = tfs_openDir(&dir);
+   if(count == 0)
+      count = tfs_readDirEntries(&dir, stats, MAX_NUM_FILES);
+   for(i = 0; i < count; i++) {
+      snprintf(path, sizeof(path), "%s/%s", argv[2], stats[i].name);
+      buffer = malloc(stats[i].size + 1);
+      FD = tfs_openFile(stats[i].name);
+      read = buffer && FD >= 0 ?
+             tfs_readAt(FD, buffer, stats[i].size, 0) : READ_ERROR;
+      tfs_closeFile(FD);
+      file = read == stats[i].size ? fopen(path, "wb") : NULL;
+      // read is only a count once the file is open
+      if(!file || fwrite(buffer, 1, read, file) != (size_t)read) {
+         fprintf(stderr, "Could not unpack \"%s\"\n", stats[i].name);
+         failed++;
+      }
+      if(file)
+         fclose(file);
+      free(buffer);
+   }
+   if(count < 0)
+      fprintf(stderr, "Could not list \"%s\" (error %d)\n", argv[1], count);
+   else
+      printf("Unpacked %d files into \"%s\"\n", count - failed, argv[2]);
+
+   tfs_unmount();
+   return count < 0 || failed;
+}
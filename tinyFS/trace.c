@@ -0,0 +1,120 @@
+#include "trace.h"
+
+static FILE *tracefile = NULL;
+static uint64_t tracebase = 0;
+static int traceerror = 0;
+static int checkedenv = FALSE;
+
+static const char *opnames[TRACE_NUM_OPS] = {
+   "?", "mkfs", "mount", "unmount", "openFile", "closeFile", "writeFile",
+   "writeAt", "readAt", "readByte", "seek", "truncate", "fallocate",
+   "deleteFile", "rename", "stat", "mountRO", "writeBegin", "writeChunk",
+   "writeCommit", "writeAbort"
+};
+
+uint64_t traceClock(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int traceStart(char *filename) {
+   checkedenv = TRUE;
+   traceStop();
+   tracefile = fopen(filename, "wb");
+   if(!tracefile)
+      return OPEN_FAILURE;
+   traceerror = fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, tracefile) != 1;
+   tracebase = traceClock();
+   return 0;
+}
+
+int traceStop(void) {
+   int error;
+
+   if(!tracefile)
+      return 0;
+   error = fclose(tracefile) != 0 || traceerror;
+   tracefile = NULL;
+   return error ? WRITE_ERROR : 0;
+}
+
+static void stopatexit(void) {
+   traceStop();
+}
+
+/* Programs that don't call traceStart are traced into the file named by
+   TFS_TRACE, if it is set, from their first traced call until they exit */
+static void startfromenv(void) {
+   char *filename = getenv(TRACE_ENV);
+
+   checkedenv = TRUE;
+   if(filename && *filename && traceStart(filename) == 0)
+      atexit(stopatexit);
+}
+
+uint64_t traceBegin(void) {
+   if(!checkedenv)
+      startfromenv();
+   return tracefile ? traceClock() : 0;
+}
+
+void traceEnd(traceop op, uint64_t start, int fd, char *name, int offset,
+              int size, int result) {
+   uchar record[TRACE_RECORD_SIZE];
+   uint64_t end;
+
+   // A trace started during the call leaves it out
+   if(!tracefile || start < tracebase)
+      return;
+   end = traceClock();
+
+   memset(record, 0x00, TRACE_RECORD_SIZE);
+   record[0] = op;
+   store16(record + 2, fd);
+   if(name)
+      strncpy((char *)record + 4, name, MAX_NAME_SIZE);
+   store32(record + 12, offset);
+   store32(record + 16, size);
+   store32(record + 20, result);
+   store64(record + 24, start - tracebase);
+   store64(record + 32, end - start);
+   if(fwrite(record, TRACE_RECORD_SIZE, 1, tracefile) != 1)
+      traceerror = 1;
+}
+
+FILE *traceOpen(char *filename) {
+   char magic[TRACE_MAGIC_SIZE];
+   FILE *trace = fopen(filename, "rb");
+
+   if(!trace)
+      return NULL;
+   if(fread(magic, TRACE_MAGIC_SIZE, 1, trace) != 1 ||
+      memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+      fclose(trace);
+      return NULL;
+   }
+   return trace;
+}
+
+int traceNext(FILE *trace, tracerecord *record) {
+   uchar raw[TRACE_RECORD_SIZE];
+
+   if(fread(raw, TRACE_RECORD_SIZE, 1, trace) != 1)
+      return 0;
+   record->op = raw[0] < TRACE_NUM_OPS ? raw[0] : 0;
+   record->fd = (int16_t)load16(raw + 2);
+   memset(record->name, '\0', MAX_NAME_SIZE + 1);
+   strncpy(record->name, (char *)raw + 4, MAX_NAME_SIZE);
+   record->offset = (int32_t)load32(raw + 12);
+   record->size = (int32_t)load32(raw + 16);
+   record->result = (int32_t)load32(raw + 20);
+   record->start = load64(raw + 24);
+   record->latency = load64(raw + 32);
+   return 1;
+}
+
+const char *traceOpName(traceop op) {
+   return op > 0 && op < TRACE_NUM_OPS ? opnames[op] : opnames[0];
+}
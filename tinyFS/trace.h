@@ -0,0 +1,90 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "TinyFS.h"
+
+/* Calls a trace records. Calls not listed here run untraced */
+typedef enum traceop {
+   TRACE_MKFS = 1,
+   TRACE_MOUNT,
+   TRACE_UNMOUNT,
+   TRACE_OPEN,
+   TRACE_CLOSE,
+   TRACE_WRITE,
+   TRACE_WRITE_AT,
+   TRACE_READ_AT,
+   TRACE_READ_BYTE,
+   TRACE_SEEK,
+   TRACE_TRUNCATE,
+   TRACE_FALLOCATE,
+   TRACE_DELETE,
+   TRACE_RENAME,
+   TRACE_STAT,
+   TRACE_MOUNT_READ_ONLY,
+   TRACE_WRITE_BEGIN,
+   TRACE_WRITE_CHUNK,
+   TRACE_WRITE_COMMIT,
+   TRACE_WRITE_ABORT,
+   TRACE_NUM_OPS
+} traceop;
+
+/* A trace file is TRACE_MAGIC followed by one record per call, in the byte
+    order of codec.h:
+      op[1] unused[1] fd[2] name[8] offset[4] size[4] result[4] start[8]
+      latency[8]
+    start is nanoseconds from the start of the trace and latency is
+    nanoseconds spent in the call. Only the sizes of buffers are kept, not
+    their contents */
+#define TRACE_MAGIC "TFSTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_RECORD_SIZE 40
+/* Environment variable naming a trace file to record into when the program
+    never calls traceStart */
+#define TRACE_ENV "TFS_TRACE"
+
+/* One record of a trace, decoded. fd is -1 and name is empty for calls that
+    don't take them, and the name of a rename is the new name */
+typedef struct tracerecord {
+   traceop op;
+   int fd;
+   char name[MAX_NAME_SIZE + 1];
+   int offset;
+   int size;
+   int result;
+   uint64_t start;
+   uint64_t latency;
+} tracerecord;
+
+/* Starts recording every traced call into a new trace file filename,
+    replacing any trace already being recorded
+   Returns OPEN_FAILURE if the file can't be created */
+int traceStart(char *filename);
+
+/* Stops recording and closes the trace file
+   Returns WRITE_ERROR if any record could not be written */
+int traceStop(void);
+
+/* Returns the monotonic clock in nanoseconds */
+uint64_t traceClock(void);
+
+/* Called on entry to a traced call. Returns its start time, or 0 when nothing
+    is being recorded */
+uint64_t traceBegin(void);
+
+/* Called when a traced call that began at start returns result; appends its
+    record if a trace is being recorded */
+void traceEnd(traceop op, uint64_t start, int fd, char *name, int offset,
+              int size, int result);
+
+/* Opens trace file filename for reading and checks its magic number
+   Returns NULL if it can't be opened or is not a trace */
+FILE *traceOpen(char *filename);
+
+/* Reads the next record of a trace opened with traceOpen into record
+   Returns 1, or 0 at the end of the trace */
+int traceNext(FILE *trace, tracerecord *record);
+
+/* Returns the name of op, as the replay report prints it */
+const char *traceOpName(traceop op);
+
+#endif